@@ -0,0 +1,249 @@
+#include "BakeCheckpoint.hh"
+#include "TexelGBuffer.hh"
+
+#include <glow/common/log.hh>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+
+namespace {
+	const std::uint32_t checkpointMagic = 0x50434b42; // "BKCP"
+	const std::uint32_t checkpointVersion = 5;
+
+	// Identifies the job a stored accumulation belongs to
+	struct JobHeader {
+		std::uint64_t geometryKey;
+		std::uint32_t type;
+		std::uint32_t width;
+		std::uint32_t height;
+		std::uint32_t samplesPerTexel;
+		float maxDistance;
+		std::uint32_t samplesTaken;
+		std::uint64_t numTexels; // Zero if the job is baked along with another one
+		std::uint64_t numSunTexels; // Zero if the job does not trace the sun separately
+	};
+
+	template <typename T>
+	void hashValue(std::uint64_t& hash, const T& value) {
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+		for (std::size_t i = 0; i < sizeof(T); ++i) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+	}
+
+	// Hashed member by member, as the padding of BakeSettings is undefined
+	std::uint64_t getSettingsKey(const BakeSettings& settings) {
+		std::uint64_t hash = 14695981039346656037ull;
+		hashValue(hash, static_cast<std::uint32_t>(settings.sampleSequence));
+		hashValue(hash, settings.maxPathDepth);
+		hashValue(hash, settings.sun.direction);
+		hashValue(hash, settings.sun.color);
+		hashValue(hash, settings.sun.power);
+		hashValue(hash, settings.targetRelativeError);
+		hashValue(hash, settings.samplesPerPass);
+		hashValue(hash, static_cast<std::uint32_t>(settings.useSunLayer));
+		hashValue(hash, static_cast<std::uint32_t>(settings.usePathGuiding));
+		hashValue(hash, settings.radianceCacheDepth);
+		return hash;
+	}
+
+	JobHeader makeJobHeader(const BakeJob& job) {
+		JobHeader header = {};
+		header.geometryKey = getTexelGBufferKey(*job.primitive, job.width, job.height);
+		header.type = static_cast<std::uint32_t>(job.type);
+		header.width = job.width;
+		header.height = job.height;
+		header.samplesPerTexel = job.samplesPerTexel;
+		header.maxDistance = job.maxDistance;
+		return header;
+	}
+
+	bool readCheckpointFile(const std::string& path, const std::vector<BakeJob>& jobs, const BakeSettings& settings,
+							std::vector<BakeAccumulation>& accumulations, std::uint32_t& shardIndex, std::uint32_t& shardCount) {
+		std::ifstream inputFile(path, std::ios::binary | std::ios::in);
+		if (!inputFile) {
+			return false;
+		}
+
+		std::uint32_t magic = 0;
+		std::uint32_t version = 0;
+		std::uint32_t numJobs = 0;
+		std::uint64_t settingsKey = 0;
+		inputFile.read(reinterpret_cast<char*>(&magic), sizeof(std::uint32_t));
+		inputFile.read(reinterpret_cast<char*>(&version), sizeof(std::uint32_t));
+		inputFile.read(reinterpret_cast<char*>(&numJobs), sizeof(std::uint32_t));
+		inputFile.read(reinterpret_cast<char*>(&shardIndex), sizeof(std::uint32_t));
+		inputFile.read(reinterpret_cast<char*>(&shardCount), sizeof(std::uint32_t));
+		inputFile.read(reinterpret_cast<char*>(&settingsKey), sizeof(std::uint64_t));
+		if (!inputFile || magic != checkpointMagic || version != checkpointVersion || numJobs != jobs.size()
+				|| shardCount == 0 || shardIndex >= shardCount) {
+			return false;
+		}
+
+		if (settingsKey != getSettingsKey(settings)) {
+			glow::warning() << "The samples in " << path << " were taken with different bake settings";
+			return false;
+		}
+
+		std::vector<BakeAccumulation> loaded(jobs.size());
+		for (std::size_t j = 0; j < jobs.size(); ++j) {
+			JobHeader expected = makeJobHeader(jobs[j]);
+			JobHeader header;
+			inputFile.read(reinterpret_cast<char*>(&header), sizeof(JobHeader));
+			if (!inputFile || header.geometryKey != expected.geometryKey || header.type != expected.type
+					|| header.width != expected.width || header.height != expected.height
+					|| header.samplesPerTexel != expected.samplesPerTexel || header.maxDistance != expected.maxDistance
+					|| (header.numTexels != 0 && header.numTexels != static_cast<std::uint64_t>(jobs[j].width) * jobs[j].height)
+					|| (header.numSunTexels != 0 && header.numSunTexels != header.numTexels)) {
+				return false;
+			}
+
+			BakeAccumulation& accumulation = loaded[j];
+			accumulation.samplesPerTexel = header.samplesTaken;
+			accumulation.sums.resize(header.numTexels);
+			accumulation.sunSums.resize(header.numSunTexels);
+			accumulation.squareSums.resize(header.numTexels);
+			accumulation.numSamples.resize(header.numTexels);
+			accumulation.samplesTaken.resize(header.numTexels);
+			accumulation.sampleIndices.resize(header.numTexels);
+			inputFile.read(reinterpret_cast<char*>(accumulation.sums.data()), header.numTexels * sizeof(glm::vec4));
+			inputFile.read(reinterpret_cast<char*>(accumulation.sunSums.data()), header.numSunTexels * sizeof(glm::vec3));
+			inputFile.read(reinterpret_cast<char*>(accumulation.squareSums.data()), header.numTexels * sizeof(glm::vec2));
+			inputFile.read(reinterpret_cast<char*>(accumulation.numSamples.data()), header.numTexels * sizeof(std::uint32_t));
+			inputFile.read(reinterpret_cast<char*>(accumulation.samplesTaken.data()), header.numTexels * sizeof(std::uint32_t));
+			inputFile.read(reinterpret_cast<char*>(accumulation.sampleIndices.data()), header.numTexels * sizeof(std::uint32_t));
+		}
+
+		if (!inputFile) {
+			return false;
+		}
+
+		accumulations = std::move(loaded);
+		return true;
+	}
+}
+
+bool writeBakeCheckpoint(const std::string& path, const std::vector<BakeJob>& jobs, const BakeSettings& settings,
+						 const std::vector<BakeAccumulation>& accumulations, int shardIndex, int shardCount) {
+	std::string tempPath = path + ".tmp";
+	std::ofstream outputFile(tempPath, std::ios::binary | std::ios::trunc | std::ios::out);
+	if (!outputFile) {
+		return false;
+	}
+
+	std::uint32_t numJobs = static_cast<std::uint32_t>(jobs.size());
+	std::uint32_t shard[2] = { static_cast<std::uint32_t>(shardIndex), static_cast<std::uint32_t>(shardCount) };
+	std::uint64_t settingsKey = getSettingsKey(settings);
+	outputFile.write(reinterpret_cast<const char*>(&checkpointMagic), sizeof(std::uint32_t));
+	outputFile.write(reinterpret_cast<const char*>(&checkpointVersion), sizeof(std::uint32_t));
+	outputFile.write(reinterpret_cast<const char*>(&numJobs), sizeof(std::uint32_t));
+	outputFile.write(reinterpret_cast<const char*>(shard), sizeof(shard));
+	outputFile.write(reinterpret_cast<const char*>(&settingsKey), sizeof(std::uint64_t));
+
+	for (std::size_t j = 0; j < jobs.size(); ++j) {
+		const BakeAccumulation& accumulation = accumulations[j];
+		JobHeader header = makeJobHeader(jobs[j]);
+		header.samplesTaken = accumulation.samplesPerTexel;
+		header.numTexels = accumulation.sums.size();
+		header.numSunTexels = accumulation.sunSums.size();
+		outputFile.write(reinterpret_cast<const char*>(&header), sizeof(JobHeader));
+
+		outputFile.write(reinterpret_cast<const char*>(accumulation.sums.data()), header.numTexels * sizeof(glm::vec4));
+		outputFile.write(reinterpret_cast<const char*>(accumulation.sunSums.data()), header.numSunTexels * sizeof(glm::vec3));
+		outputFile.write(reinterpret_cast<const char*>(accumulation.squareSums.data()), header.numTexels * sizeof(glm::vec2));
+		outputFile.write(reinterpret_cast<const char*>(accumulation.numSamples.data()), header.numTexels * sizeof(std::uint32_t));
+		outputFile.write(reinterpret_cast<const char*>(accumulation.samplesTaken.data()), header.numTexels * sizeof(std::uint32_t));
+		outputFile.write(reinterpret_cast<const char*>(accumulation.sampleIndices.data()), header.numTexels * sizeof(std::uint32_t));
+	}
+
+	outputFile.close();
+	if (!outputFile) {
+		std::remove(tempPath.c_str());
+		return false;
+	}
+
+#ifdef _WIN32
+	// Unlike POSIX rename, the Windows one fails if the destination exists
+	std::remove(path.c_str());
+#endif
+	return std::rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+bool readBakeCheckpoint(const std::string& path, const std::vector<BakeJob>& jobs, const BakeSettings& settings,
+						std::vector<BakeAccumulation>& accumulations, int shardIndex, int shardCount) {
+	std::vector<BakeAccumulation> loaded;
+	std::uint32_t loadedShardIndex = 0;
+	std::uint32_t loadedShardCount = 0;
+	if (!readCheckpointFile(path, jobs, settings, loaded, loadedShardIndex, loadedShardCount)
+			|| loadedShardIndex != static_cast<std::uint32_t>(shardIndex) || loadedShardCount != static_cast<std::uint32_t>(shardCount)) {
+		return false;
+	}
+
+	accumulations = std::move(loaded);
+	return true;
+}
+
+bool mergeBakeCheckpoints(const std::vector<std::string>& paths, const std::vector<BakeJob>& jobs, const BakeSettings& settings,
+						  std::vector<BakeAccumulation>& accumulations) {
+	std::vector<BakeAccumulation> merged;
+	std::vector<bool> shardsFound;
+	for (const std::string& path : paths) {
+		std::vector<BakeAccumulation> shard;
+		std::uint32_t shardIndex = 0;
+		std::uint32_t shardCount = 0;
+		if (!readCheckpointFile(path, jobs, settings, shard, shardIndex, shardCount)) {
+			glow::error() << "Could not read the shard " << path << " or it belongs to a different bake";
+			return false;
+		}
+
+		if (shardsFound.empty()) {
+			shardsFound.resize(shardCount, false);
+			merged = std::move(shard);
+		}
+		else if (shardsFound.size() != shardCount || shardsFound[shardIndex]) {
+			glow::error() << "The shard " << path << " does not belong to the same set of shards";
+			return false;
+		}
+		else {
+			// The shards have disjoint texels, the others of a shard have no samples. A shard
+			// that ran out of time limits the sample count of the whole bake.
+			for (std::size_t j = 0; j < jobs.size(); ++j) {
+				BakeAccumulation& accumulation = merged[j];
+				if (accumulation.sums.size() != shard[j].sums.size() || accumulation.sunSums.size() != shard[j].sunSums.size()) {
+					glow::error() << "The shard " << path << " does not belong to the same set of shards";
+					return false;
+				}
+
+				accumulation.samplesPerTexel = std::min(accumulation.samplesPerTexel, shard[j].samplesPerTexel);
+				for (std::size_t i = 0; i < accumulation.sums.size(); ++i) {
+					accumulation.sums[i] += shard[j].sums[i];
+					if (!accumulation.sunSums.empty()) {
+						accumulation.sunSums[i] += shard[j].sunSums[i];
+					}
+					accumulation.squareSums[i] += shard[j].squareSums[i];
+					accumulation.numSamples[i] += shard[j].numSamples[i];
+					accumulation.samplesTaken[i] += shard[j].samplesTaken[i];
+					accumulation.sampleIndices[i] = std::max(accumulation.sampleIndices[i], shard[j].sampleIndices[i]);
+				}
+			}
+		}
+
+		shardsFound[shardIndex] = true;
+	}
+
+	for (std::size_t i = 0; i < shardsFound.size(); ++i) {
+		if (!shardsFound[i]) {
+			glow::error() << "Shard " << i << "/" << shardsFound.size() << " is missing";
+			return false;
+		}
+	}
+
+	if (shardsFound.empty()) {
+		return false;
+	}
+
+	accumulations = std::move(merged);
+	return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "DirectionalLight.hh"
+#include "IlluminationBaker.hh"
+#include "Sampler.hh"
+
+#include <string>
+#include <vector>
+
+// Settings that change the samples of a bake but not its jobs. The samples of a checkpoint
+// or shard are only combined with ones that were taken with the same settings.
+struct BakeSettings {
+	SampleSequence sampleSequence = SampleSequence::Sobol;
+	int maxPathDepth = 0;
+	DirectionalLight sun;
+	float targetRelativeError = 0.0f;
+	int samplesPerPass = 0; // As requested, zero for the default of the bake mode
+	bool useSunLayer = true;
+	bool usePathGuiding = false;
+	int radianceCacheDepth = 0;
+};
+
+// Writes the accumulated samples of a progressive bake or of one shard of a bake. The
+// checkpoint is written to a temporary file that is then renamed, so an existing
+// checkpoint is only ever replaced by a complete one.
+bool writeBakeCheckpoint(const std::string& path, const std::vector<BakeJob>& jobs, const BakeSettings& settings,
+	const std::vector<BakeAccumulation>& accumulations, int shardIndex = 0, int shardCount = 1);
+
+// Fails if there is no checkpoint or it was written for other jobs, settings, geometry or shard
+bool readBakeCheckpoint(const std::string& path, const std::vector<BakeJob>& jobs, const BakeSettings& settings,
+	std::vector<BakeAccumulation>& accumulations, int shardIndex = 0, int shardCount = 1);
+
+// Combines the checkpoints of all shards of a bake into the accumulations of the whole bake.
+// Fails if a checkpoint cannot be read or the shards are incomplete.
+bool mergeBakeCheckpoints(const std::vector<std::string>& paths, const std::vector<BakeJob>& jobs, const BakeSettings& settings,
+	std::vector<BakeAccumulation>& accumulations);
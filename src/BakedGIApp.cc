@@ -70,6 +70,10 @@ void BakedGIApp::init() {
 	TwAddVarRW(tweakbar(), "Light Color", TW_TYPE_COLOR3F, &scene.getSun().color, "group=light");
 	TwAddVarRW(tweakbar(), "Light Power", TW_TYPE_FLOAT, &scene.getSun().power, "group=light min=0.0 step=0.1");
 	TwAddVarRW(tweakbar(), "Light Dir", TW_TYPE_DIR3F, &scene.getSun().direction, "group=light");
+	TwAddVarRW(tweakbar(), "Sky Intensity", TW_TYPE_FLOAT, &skyIntensity, "group=light min=0.0 step=0.1");
+	if (scene.hasTimeOfDay()) {
+		TwAddVarRW(tweakbar(), "Time of Day", TW_TYPE_FLOAT, &timeOfDay, "group=light min=0.0 max=1.0 step=0.01");
+	}
 	TwAddVarRW(tweakbar(), "Shadow Map Size", TwDefineEnum("", nullptr, 0), &shadowMapSize,
 		"group=light, enum='64 {64}, 128 {128}, 256 {256}, 512 {512}, 1024 {1024}, 2048 {2048}, 4096 {4096}'");
 	TwAddVarRW(tweakbar(), "Shadow Map Offset", TW_TYPE_FLOAT, &shadowMapOffset, "group=light step=0.0001");
@@ -199,6 +203,10 @@ void BakedGIApp::render(float elapsedSeconds) {
 	//pipeline->setUseLocalProbes(useLocalProbes);
 	pipeline->setBloomPercentage(bloomPercentage);
 	pipeline->setExposureAdjustment(exposureAdjustment);
+	pipeline->setSkyIntensity(skyIntensity);
+	if (scene.hasTimeOfDay()) {
+		scene.setTimeOfDay(timeOfDay);
+	}
 	pipeline->setDebugEnvMapMipLevel(debugEnvMapMipLevel);
 	pipeline->setDebugReflProbeGridEnabled(showDebugEnvProbes);
 	pipeline->setShowDebugProbeVisGrid(showProbeVisGrid);
@@ -70,6 +70,8 @@ private:
 	bool useAOMap = true;
 	float bloomPercentage = 0.02f;
 	float exposureAdjustment = 1.0f;
+	float skyIntensity = 1.0f;
+	float timeOfDay = 0.5f;
 	int debugEnvMapMipLevel = 0;
 	bool showDebugEnvProbes = false;
 	bool useIbl = true;
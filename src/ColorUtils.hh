@@ -2,11 +2,24 @@
 
 #include <glm/glm.hpp>
 #include <cmath>
+#include <array>
 
 inline glm::vec3 gammaToLinear(const glm::vec3& v) {
 	return { std::pow(v.x, 2.2f), std::pow(v.y, 2.2f) , std::pow(v.z, 2.2f) };
 }
 
+// Same curve as gammaToLinear() for 8 bit channels, as a lookup table
+inline float gammaToLinear(unsigned char v) {
+	static const std::array<float, 256> table = [] {
+		std::array<float, 256> t;
+		for (int i = 0; i < 256; ++i) {
+			t[i] = std::pow(i / 255.0f, 2.2f);
+		}
+		return t;
+	}();
+	return table[v];
+}
+
 inline glm::vec3 linearToGamma(const glm::vec3& v) {
 	return { std::pow(v.x, 1.0f / 2.2f), std::pow(v.y, 1.0f / 2.2f) , std::pow(v.z, 1.0f / 2.2f) };
 }
\ No newline at end of file
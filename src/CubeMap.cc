@@ -1,7 +1,61 @@
 #include "CubeMap.hh"
 #include "third-party/stb_image.h"
 #include <glow/common/log.hh>
+#include <algorithm>
 #include <cstring>
+#include <cmath>
+
+namespace {
+	// Face coordinates in [-1, 1] of a direction, with the same orientation as CubeMap::sample()
+	int getFaceCoords(const glm::vec3& dir, glm::vec2& st) {
+		glm::vec3 absDir = glm::abs(dir);
+		if (absDir.x >= absDir.y && absDir.x >= absDir.z) {
+			st = (dir.x > 0) ? glm::vec2(-dir.z, dir.y) / absDir.x : glm::vec2(dir.z, dir.y) / absDir.x;
+			return (dir.x > 0) ? 0 : 1;
+		}
+		else if (absDir.y >= absDir.z) {
+			st = (dir.y > 0) ? glm::vec2(dir.x, -dir.z) / absDir.y : glm::vec2(dir.x, dir.z) / absDir.y;
+			return (dir.y > 0) ? 2 : 3;
+		}
+		else {
+			st = (dir.z > 0) ? glm::vec2(dir.x, dir.y) / absDir.z : glm::vec2(-dir.x, dir.y) / absDir.z;
+			return (dir.z > 0) ? 4 : 5;
+		}
+	}
+
+	glm::vec3 getFaceDirection(int face, const glm::vec2& st) {
+		switch (face) {
+		case 0: return glm::vec3(1.0f, st.y, -st.x);
+		case 1: return glm::vec3(-1.0f, st.y, st.x);
+		case 2: return glm::vec3(st.x, 1.0f, -st.y);
+		case 3: return glm::vec3(st.x, -1.0f, st.y);
+		case 4: return glm::vec3(st.x, st.y, 1.0f);
+		default: return glm::vec3(-st.x, st.y, -1.0f);
+		}
+	}
+
+	// Solid angle per unit area on a face at distance one
+	float getSolidAngleDensity(const glm::vec2& st) {
+		float r = std::sqrt(1.0f + glm::dot(st, st));
+		return 1.0f / (r * r * r);
+	}
+
+	// Picks the interval of a cdf and returns u remapped to [0, 1) within that interval
+	int sampleCdf(const float* cdf, int count, float u, float& remapped) {
+		int index = static_cast<int>(std::upper_bound(cdf, cdf + count + 1, u) - cdf) - 1;
+		index = glm::clamp(index, 0, count - 1);
+		float width = cdf[index + 1] - cdf[index];
+		remapped = (width > 0.0f) ? glm::clamp((u - cdf[index]) / width, 0.0f, 0.99999994f) : 0.5f;
+		return index;
+	}
+
+	void normalizeCdf(float* cdf, int count) {
+		float total = cdf[count];
+		for (int i = 0; i <= count; ++i) {
+			cdf[i] = (total > 0.0f) ? cdf[i] / total : static_cast<float>(i) / count;
+		}
+	}
+}
 
 glm::vec3 CubeMap::sample(const glm::vec3& dir) const {
     glm::vec3 absDir = glm::abs(dir);
@@ -45,6 +99,114 @@ glm::vec3 CubeMap::sample(const glm::vec3& dir) const {
 	return glm::vec3(0.0f);
 }
 
+void CubeMap::buildSamplingDistribution(int resolution) {
+	distributionResolution = resolution;
+	float binArea = 4.0f / (resolution * resolution);
+
+	// Average luminance of the texels in every bin
+	std::vector<float> luminance[6];
+	float totalLuminance = 0.0f;
+	float totalSolidAngle = 0.0f;
+	for (int f = 0; f < 6; ++f) {
+		const Image& face = *faces[f];
+		luminance[f].assign(resolution * resolution, 0.0f);
+		std::vector<int> texelCounts(resolution * resolution, 0);
+		int channels = face.getChannels();
+		for (int y = 0; y < face.getHeight(); ++y) {
+			// Rows are stored top down, sample() flips them
+			int row = std::min((face.getHeight() - y - 1) * resolution / face.getHeight(), resolution - 1);
+			for (int x = 0; x < face.getWidth(); ++x) {
+				int column = std::min(x * resolution / face.getWidth(), resolution - 1);
+				const unsigned char* texel = face.getDataPtr() + face.getTexelIndex(x, y) * channels;
+				glm::vec3 color(texel[0], texel[std::min(1, channels - 1)], texel[std::min(2, channels - 1)]);
+				luminance[f][column + row * resolution] += glm::dot(color / 255.0f, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+				texelCounts[column + row * resolution]++;
+			}
+		}
+
+		for (int bin = 0; bin < resolution * resolution; ++bin) {
+			luminance[f][bin] /= std::max(texelCounts[bin], 1);
+			glm::vec2 st = (glm::vec2(bin % resolution, bin / resolution) + glm::vec2(0.5f)) / static_cast<float>(resolution) * 2.0f - glm::vec2(1.0f);
+			totalLuminance += luminance[f][bin] * getSolidAngleDensity(st) * binArea;
+			totalSolidAngle += getSolidAngleDensity(st) * binArea;
+		}
+	}
+
+	// The distribution is only used together with BSDF sampling (MIS), which already handles
+	// the smooth part of the sky well, so half the average luminance is taken off every bin.
+	// The floor keeps every direction sampleable, so the distribution is never empty.
+	float average = totalLuminance / totalSolidAngle;
+	float offset = 0.5f * average;
+	float minValue = 0.05f * average;
+
+	float faceWeights[6];
+	for (int f = 0; f < 6; ++f) {
+		FaceDistribution& distribution = distributions[f];
+		distribution.rowCdf.assign(resolution + 1, 0.0f);
+		distribution.columnCdfs.assign((resolution + 1) * resolution, 0.0f);
+		distribution.binProbabilities.resize(resolution * resolution);
+		for (int row = 0; row < resolution; ++row) {
+			float* columnCdf = &distribution.columnCdfs[row * (resolution + 1)];
+			for (int column = 0; column < resolution; ++column) {
+				int bin = column + row * resolution;
+				glm::vec2 st = (glm::vec2(column, row) + glm::vec2(0.5f)) / static_cast<float>(resolution) * 2.0f - glm::vec2(1.0f);
+				float value = std::max(luminance[f][bin] - offset, minValue);
+				distribution.binProbabilities[bin] = value * getSolidAngleDensity(st) * binArea;
+				columnCdf[column + 1] = columnCdf[column] + distribution.binProbabilities[bin];
+			}
+			distribution.rowCdf[row + 1] = distribution.rowCdf[row] + columnCdf[resolution];
+			normalizeCdf(columnCdf, resolution);
+		}
+
+		faceWeights[f] = distribution.rowCdf[resolution];
+		normalizeCdf(distribution.rowCdf.data(), resolution);
+	}
+
+	faceCdf[0] = 0.0f;
+	for (int f = 0; f < 6; ++f) {
+		faceCdf[f + 1] = faceCdf[f] + faceWeights[f];
+	}
+	float total = faceCdf[6];
+	normalizeCdf(faceCdf, 6);
+
+	for (int f = 0; f < 6; ++f) {
+		for (float& probability : distributions[f].binProbabilities) {
+			probability = (total > 0.0f) ? probability / total : 0.0f;
+		}
+	}
+}
+
+bool CubeMap::hasSamplingDistribution() const {
+	return distributionResolution > 0;
+}
+
+glm::vec3 CubeMap::sampleDirection(const glm::vec2& u, float uFace, float& pdf) const {
+	int resolution = distributionResolution;
+	float unused;
+	int face = sampleCdf(faceCdf, 6, uFace, unused);
+	const FaceDistribution& distribution = distributions[face];
+
+	float rowOffset;
+	float columnOffset;
+	int row = sampleCdf(distribution.rowCdf.data(), resolution, u.y, rowOffset);
+	int column = sampleCdf(&distribution.columnCdfs[row * (resolution + 1)], resolution, u.x, columnOffset);
+
+	glm::vec2 st = glm::vec2(column + columnOffset, row + rowOffset) / static_cast<float>(resolution) * 2.0f - glm::vec2(1.0f);
+	float binArea = 4.0f / (resolution * resolution);
+	pdf = distribution.binProbabilities[column + row * resolution] / (binArea * getSolidAngleDensity(st));
+	return glm::normalize(getFaceDirection(face, st));
+}
+
+float CubeMap::pdfDirection(const glm::vec3& dir) const {
+	int resolution = distributionResolution;
+	glm::vec2 st;
+	int face = getFaceCoords(dir, st);
+
+	glm::ivec2 bin = glm::clamp(glm::ivec2((st * 0.5f + glm::vec2(0.5f)) * static_cast<float>(resolution)), 0, resolution - 1);
+	float binArea = 4.0f / (resolution * resolution);
+	return distributions[face].binProbabilities[bin.x + bin.y * resolution] / (binArea * getSolidAngleDensity(st));
+}
+
 SharedCubeMap CubeMap::loadFromFiles(const std::string& posX, const std::string& negX,
                               const std::string& posY, const std::string& negY,
                               const std::string& posZ, const std::string& negZ) {
@@ -56,6 +218,8 @@ SharedCubeMap CubeMap::loadFromFiles(const std::string& posX, const std::string&
 		cubeMap->faces[i] = std::make_shared<Image>(width, height, GL_SRGB);
         std::memcpy(cubeMap->faces[i]->getDataPtr(), data, width * height * channel);
         stbi_image_free(data);
+		cubeMap->faces[i]->setLayout(ImageLayout::Tiled); // Direction lookups are incoherent
     }
+	cubeMap->buildSamplingDistribution();
     return cubeMap;
 }
@@ -5,10 +5,21 @@
 #include <glm/glm.hpp>
 #include <string>
 #include <memory>
+#include <vector>
 
 class CubeMap {
 public:
     glm::vec3 sample(const glm::vec3& dir) const;
+
+	// Luminance based importance sampling of directions, meant to be combined with BSDF
+	// sampling by MIS. Every face has a 2D distribution over a grid of bins (rows first,
+	// then columns within a row) and the face itself is picked by its total weight. Bins
+	// are weighted by their luminance minus half the average, but at least a twentieth of
+	// the average. The pdf is with respect to solid angle.
+	void buildSamplingDistribution(int resolution = 128);
+	bool hasSamplingDistribution() const;
+	glm::vec3 sampleDirection(const glm::vec2& u, float uFace, float& pdf) const;
+	float pdfDirection(const glm::vec3& dir) const;
     
     static std::shared_ptr<CubeMap> loadFromFiles(
         const std::string& posX, const std::string& negX,
@@ -16,7 +27,16 @@ public:
         const std::string& posZ, const std::string& negZ);
     
 private:
+	struct FaceDistribution {
+		std::vector<float> rowCdf; // resolution + 1 entries
+		std::vector<float> columnCdfs; // resolution + 1 entries per row
+		std::vector<float> binProbabilities; // Including the probability of the face
+	};
+
     SharedImage faces[6]; // +x -x +y -y +z -z
+	FaceDistribution distributions[6];
+	float faceCdf[7];
+	int distributionResolution = 0;
 };
 
 using SharedCubeMap = std::shared_ptr<CubeMap>;
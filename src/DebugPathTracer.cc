@@ -4,13 +4,6 @@
 #include <glow/objects/Texture2D.hh>
 #include <glow/data/SurfaceData.hh>
 #include <glow/data/TextureData.hh>
-#include <random>
-
-namespace {
-	std::random_device randDevice;
-	std::default_random_engine randEngine(randDevice());
-	std::uniform_real_distribution<float> uniformDist(0.0f, 1.0f);
-}
 
 void DebugPathTracer::traceDebugImage() {
 	std::vector<glm::vec3> colors(debugImage.size(), glm::vec3(0.0f));
@@ -23,13 +16,16 @@ void DebugPathTracer::traceDebugImage() {
 				float aspect = debugImageWidth / static_cast<float>(debugImageHeight);
 				float fov = debugCamera->getHorizontalFieldOfView();
 				float scale = std::tan(glm::radians(fov * 0.5f));
-				float newX = x + uniformDist(randEngine) - 0.5f;
-				float newY = y + uniformDist(randEngine) - 0.5f;
+				Sampler sampler(static_cast<std::uint32_t>(x + y * debugImageWidth), k, 0, sampleSequence);
+				glm::vec2 jitter = sampler.next2D();
+				float newX = x + jitter.x - 0.5f;
+				float newY = y + jitter.y - 0.5f;
 				float px = (2.0f * ((newX + 0.5f) / debugImageWidth) - 1.0f) * scale * aspect;
 				float py = (1.0f - 2.0f * ((newY + 0.5f) / debugImageHeight)) * scale;
 
 				glm::vec3 dir = glm::transpose(debugCamera->getViewMatrix()) * glm::vec4(px, py, -1, 0);
-				colors[x + y * debugImageWidth] += trace(debugCamera->getPosition(), dir, glm::vec3(1.0f));
+				float pixelSpread = 2.0f * scale / debugImageHeight;
+				colors[x + y * debugImageWidth] += trace(debugCamera->getPosition(), dir, sampler, pixelSpread);
 			}
 		}
 	}
@@ -51,6 +47,10 @@ void DebugPathTracer::setSamplesPerPixel(unsigned int sampleCount) {
 	samplesPerPixel = sampleCount;
 }
 
+void DebugPathTracer::setSampleSequence(SampleSequence sequence) {
+	sampleSequence = sequence;
+}
+
 void DebugPathTracer::setDebugImageSize(int width, int height) {
 	debugImageWidth = width;
 	debugImageHeight = height;
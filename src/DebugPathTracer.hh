@@ -10,6 +10,7 @@ public:
 	void traceDebugImage();
 	void attachDebugCamera(const glow::camera::GenericCamera& camera);
 	void setSamplesPerPixel(unsigned int sampleCount);
+	void setSampleSequence(SampleSequence sequence);
 	void setDebugImageSize(int width, int height);
 	glow::SharedTexture2D getDebugTexture() const;
 	void saveDebugImageToFile(const std::string& path) const;
@@ -21,4 +22,5 @@ private:
 	glow::SharedTexture2D debugTexture;
 	const glow::camera::GenericCamera* debugCamera;
 	unsigned int samplesPerPixel;
+	SampleSequence sampleSequence = SampleSequence::Sobol;
 };
@@ -1,39 +1,156 @@
 #include "IlluminationBaker.hh"
+#include "LightMapDenoiser.hh"
 #include "Primitive.hh"
 #include "PathTracer.hh"
 
 #include <glow/common/log.hh>
 #include <glm/gtc/packing.hpp>
-#include <random>
+#include <algorithm>
+#include <iomanip>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <tuple>
 
 namespace {
-    glm::vec3 getBarycentricCoords(const glm::vec2& p, const glm::vec2& a,
-                                   const glm::vec2& b, const glm::vec2& c) {
-        glm::vec2 v0 = b - a;
-        glm::vec2 v1 = c - a;
-        glm::vec2 v2 = p - a;
-
-        float dot00 = glm::dot(v0, v0);
-        float dot01 = glm::dot(v0, v1);
-		float dot11 = glm::dot(v1, v1);
-        float dot20 = glm::dot(v2, v0);
-        float dot21 = glm::dot(v2, v1);
-
-        float invDenom = 1.0f / (dot00 * dot11 - dot01 * dot01);
-        float v = (dot11 * dot20 - dot01 * dot21) * invDenom;
-        float w = (dot00 * dot21 - dot01 * dot20) * invDenom;
-		float u = 1.0f - v - w;
-        
-        return glm::vec3(u, v, w);
-    }
-    
-    bool isPointInTriangle(const glm::vec3& barycentric) {
-        return (barycentric.y >= 0.0f) && (barycentric.z >= 0.0f) && (barycentric.y + barycentric.z <= 1.0f);
-    }
-    
-    std::random_device randDevice;
-	std::default_random_engine randEngine(randDevice());
-	std::uniform_real_distribution<float> uniformDist(0.0f, 1.0f);
+	bool isPointInTriangle(const glm::vec3& barycentric) {
+		return (barycentric.y >= 0.0f) && (barycentric.z >= 0.0f) && (barycentric.y + barycentric.z <= 1.0f);
+	}
+
+	// Normalized edge functions of a triangle in texel space. Evaluated at a point they
+	// give its barycentric coordinates: barycentric = dx * x + dy * y + offset.
+	struct EdgeFunctions {
+		glm::vec3 dx;
+		glm::vec3 dy;
+		glm::vec3 offset;
+	};
+
+	bool setupEdgeFunctions(const glm::vec2& p0, const glm::vec2& p1, const glm::vec2& p2, EdgeFunctions& edges) {
+		float area = (p1.x - p0.x) * (p2.y - p0.y) - (p1.y - p0.y) * (p2.x - p0.x);
+		if (area == 0.0f) {
+			return false;
+		}
+
+		float invArea = 1.0f / area;
+		edges.dx = glm::vec3(p1.y - p2.y, p2.y - p0.y, p0.y - p1.y) * invArea;
+		edges.dy = glm::vec3(p2.x - p1.x, p0.x - p2.x, p1.x - p0.x) * invArea;
+		edges.offset = glm::vec3(p1.x * p2.y - p2.x * p1.y, p2.x * p0.y - p0.x * p2.y, p0.x * p1.y - p1.x * p0.y) * invArea;
+		return true;
+	}
+
+	// Calls emit(x, y, barycentric) for every texel of a triangle given in texel coordinates,
+	// with the barycentric coordinates of the texel center. The edge functions are stepped
+	// incrementally from row to row and evaluated for a whole row at once. In conservative
+	// mode every texel whose square overlaps the triangle is emitted, otherwise only the
+	// texels whose center is inside.
+	template <typename Emit>
+	void rasterizeTriangle(const glm::vec2& p0, const glm::vec2& p1, const glm::vec2& p2,
+						   int width, int height, bool conservative, Emit emit) {
+		EdgeFunctions edges;
+		if (!setupEdgeFunctions(p0, p1, p2, edges)) {
+			return;
+		}
+
+		int minX = std::max(static_cast<int>(std::floor(std::min(p0.x, std::min(p1.x, p2.x)))), 0);
+		int minY = std::max(static_cast<int>(std::floor(std::min(p0.y, std::min(p1.y, p2.y)))), 0);
+		int maxX = std::min(static_cast<int>(std::floor(std::max(p0.x, std::max(p1.x, p2.x)))), width - 1);
+		int maxY = std::min(static_cast<int>(std::floor(std::max(p0.y, std::max(p1.y, p2.y)))), height - 1);
+		if (minX > maxX || minY > maxY) {
+			return;
+		}
+
+		// Moving the edges outwards by half a texel makes the center test conservative
+		glm::vec3 threshold(0.0f);
+		if (conservative) {
+			threshold = -0.5f * (glm::abs(edges.dx) + glm::abs(edges.dy));
+		}
+
+		int rowLength = maxX - minX + 1;
+		std::vector<unsigned char> rowMask(rowLength);
+		glm::vec3 rowStart = edges.dx * (minX + 0.5f) + edges.dy * (minY + 0.5f) + edges.offset;
+
+		for (int y = minY; y <= maxY; ++y, rowStart += edges.dy) {
+			float start0 = rowStart.x, start1 = rowStart.y, start2 = rowStart.z;
+			float step0 = edges.dx.x, step1 = edges.dx.y, step2 = edges.dx.z;
+			float threshold0 = threshold.x, threshold1 = threshold.y, threshold2 = threshold.z;
+			unsigned char* mask = rowMask.data();
+
+			#pragma omp simd
+			for (int i = 0; i < rowLength; ++i) {
+				float w0 = start0 + step0 * i;
+				float w1 = start1 + step1 * i;
+				float w2 = start2 + step2 * i;
+				mask[i] = (w0 >= threshold0) & (w1 >= threshold1) & (w2 >= threshold2);
+			}
+
+			for (int i = 0; i < rowLength; ++i) {
+				if (mask[i]) {
+					emit(minX + i, y, rowStart + edges.dx * static_cast<float>(i));
+				}
+			}
+		}
+	}
+
+	// Splits the triangles of a primitive into the charts of its light map layout. Triangles
+	// that share a vertex are in the same chart, where vertices with the same position and
+	// light map coordinates count as one, so the seams of the layout separate the charts.
+	// Returns the chart of every triangle, as the lowest vertex index of the chart.
+	std::vector<unsigned int> getLightMapCharts(const Primitive& primitive) {
+		std::vector<unsigned int> parents(primitive.positions.size());
+		std::iota(parents.begin(), parents.end(), 0u);
+
+		auto find = [&](unsigned int v) {
+			while (parents[v] != v) {
+				parents[v] = parents[parents[v]];
+				v = parents[v];
+			}
+			return v;
+		};
+		auto merge = [&](unsigned int a, unsigned int b) {
+			a = find(a);
+			b = find(b);
+			parents[std::max(a, b)] = std::min(a, b);
+		};
+
+		auto getVertexKey = [&](unsigned int v) {
+			const glm::vec2& t = primitive.lightMapTexCoords[v];
+			const glm::vec3& p = primitive.positions[v];
+			return std::make_tuple(t.x, t.y, p.x, p.y, p.z);
+		};
+
+		std::vector<unsigned int> vertices(primitive.positions.size());
+		std::iota(vertices.begin(), vertices.end(), 0u);
+		std::sort(vertices.begin(), vertices.end(), [&](unsigned int a, unsigned int b) {
+			return getVertexKey(a) < getVertexKey(b);
+		});
+		for (std::size_t i = 1; i < vertices.size(); ++i) {
+			if (getVertexKey(vertices[i]) == getVertexKey(vertices[i - 1])) {
+				merge(vertices[i], vertices[i - 1]);
+			}
+		}
+
+		for (std::size_t i = 0; i < primitive.indices.size(); i += 3) {
+			merge(primitive.indices[i], primitive.indices[i + 1]);
+			merge(primitive.indices[i], primitive.indices[i + 2]);
+		}
+
+		std::vector<unsigned int> charts(primitive.indices.size() / 3);
+		for (std::size_t i = 0; i < charts.size(); ++i) {
+			charts[i] = find(primitive.indices[i * 3]);
+		}
+		return charts;
+	}
+
+	// Derives a per-primitive seed so that primitives with the same light map layout
+	// do not share their sample patterns
+	std::uint32_t getPrimitiveSeed(const Primitive& primitive) {
+		std::uint32_t seed = 2166136261u;
+		for (char c : primitive.name) {
+			seed = (seed ^ static_cast<unsigned char>(c)) * 16777619u;
+		}
+		seed = (seed ^ static_cast<std::uint32_t>(primitive.indices.size())) * 16777619u;
+		return Sampler::pcgHash(seed);
+	}
 
 	void makeCoordinateSystem(const glm::vec3& normal, glm::vec3& xAxis, glm::vec3& yAxis) {
 		xAxis = glm::vec3(1.0f, 0.0f, 0.0f);
@@ -48,9 +165,98 @@ namespace {
 		xAxis = glm::normalize(glm::cross(yAxis, normal));
 	}
 
-	glm::vec3 sampleCosineHemisphere(const glm::vec3& normal) {
-		float u1 = uniformDist(randEngine);
-		float u2 = uniformDist(randEngine);
+	// Jump flooding: the index of the closest seed texel is propagated with halving step
+	// sizes, followed by one more pass with a step of one (JFA+1) to fix most of the rare
+	// errors. Texels that cannot reach any seed get -1.
+	std::vector<int> jumpFlood(const std::vector<unsigned char>& seeds, int width, int height) {
+		std::vector<int> nearest(width * height);
+		std::vector<int> next(width * height);
+		for (int i = 0; i < width * height; ++i) {
+			nearest[i] = seeds[i] ? i : -1;
+		}
+
+		int maxStep = 1;
+		while (maxStep * 2 < std::max(width, height)) {
+			maxStep *= 2;
+		}
+
+		std::vector<int> steps;
+		for (int step = maxStep; step >= 1; step /= 2) {
+			steps.push_back(step);
+		}
+		steps.push_back(1);
+
+		for (int step : steps) {
+			#pragma omp parallel for
+			for (int y = 0; y < height; ++y) {
+				for (int x = 0; x < width; ++x) {
+					int best = nearest[x + y * width];
+					int bestDistSq = std::numeric_limits<int>::max();
+					if (best != -1) {
+						int dx = best % width - x;
+						int dy = best / width - y;
+						bestDistSq = dx * dx + dy * dy;
+					}
+
+					for (int offsetY = -step; offsetY <= step; offsetY += step) {
+						int sampleY = y + offsetY;
+						if (sampleY < 0 || sampleY >= height) {
+							continue;
+						}
+
+						for (int offsetX = -step; offsetX <= step; offsetX += step) {
+							int sampleX = x + offsetX;
+							if (sampleX < 0 || sampleX >= width) {
+								continue;
+							}
+
+							int candidate = nearest[sampleX + sampleY * width];
+							if (candidate == -1) {
+								continue;
+							}
+
+							int dx = candidate % width - x;
+							int dy = candidate / width - y;
+							int distSq = dx * dx + dy * dy;
+							if (distSq < bestDistSq || (distSq == bestDistSq && candidate < best)) {
+								best = candidate;
+								bestDistSq = distSq;
+							}
+						}
+					}
+
+					next[x + y * width] = best;
+				}
+			}
+			nearest.swap(next);
+		}
+
+		return nearest;
+	}
+
+	// Index of the closest texel with samples for every texel of a light map. It depends on
+	// the samples, which differ between resolves of the same layout, so it is built per job.
+	std::vector<int> getNearestLegalTexels(int width, int height, const std::vector<std::uint32_t>& numSamples) {
+		std::vector<unsigned char> legalMap(width * height, 0);
+		for (int i = 0; i < width * height; ++i) {
+			legalMap[i] = numSamples[i] > 0;
+		}
+		return jumpFlood(legalMap, width, height);
+	}
+
+	void fillIllegalTexels(const std::vector<int>& nearestLegalTexels, std::vector<glm::vec4>& values) {
+		#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(values.size()); ++i) {
+			int nearest = nearestLegalTexels[i];
+			if (nearest != i && nearest != -1) {
+				values[i] = values[nearest];
+			}
+		}
+	}
+
+	glm::vec3 sampleCosineHemisphere(const glm::vec3& normal, const glm::vec2& u) {
+		float u1 = u.x;
+		float u2 = u.y;
 		
 		float r = std::sqrt(u1);
 		float phi = 2.0f * glm::pi<float>() * u2;
@@ -69,6 +275,61 @@ namespace {
 	float pdfCosineHemisphere(const glm::vec3& normal, const glm::vec3& wi) {
 		return glm::dot(normal, wi) / glm::pi<float>();
 	}
+
+	// Values of a sample whose noise the target relative error applies to, the luminance of
+	// the irradiance and the ambient occlusion. They are linear, so the values of the sums of
+	// a texel are the sums of its values.
+	glm::vec2 getNoiseValues(const glm::vec4& value) {
+		return glm::vec2(glm::dot(glm::vec3(value), glm::vec3(0.2126f, 0.7152f, 0.0722f)), value.w);
+	}
+
+	// Half width of the 95% confidence interval of the mean relative to the mean, from the
+	// sums of the noise values of the samples of a texel and of their squares
+	float getRelativeError(std::uint32_t count, const glm::vec2& sum, const glm::vec2& squareSum) {
+		if (count < 2) {
+			return std::numeric_limits<float>::infinity();
+		}
+
+		glm::vec2 mean = sum / static_cast<float>(count);
+		glm::vec2 variance = glm::max(squareSum - sum * mean, glm::vec2(0.0f)) / static_cast<float>(count - 1);
+		glm::vec2 halfWidth = 1.96f * glm::sqrt(variance / static_cast<float>(count));
+		glm::vec2 error = halfWidth / glm::max(glm::abs(mean), glm::vec2(1.0e-4f));
+		return std::max(error.x, error.y);
+	}
+
+	// Bounds of the samples of a texel with a noise target, a quarter of the sample count of
+	// the map (16 or more) and four times as much
+	int getMinAdaptiveSamples(int samplesPerTexel) {
+		return std::min(samplesPerTexel, std::max(samplesPerTexel / 4, 16));
+	}
+
+	int getMaxAdaptiveSamples(int samplesPerTexel) {
+		return samplesPerTexel > std::numeric_limits<int>::max() / 4 ? std::numeric_limits<int>::max() : samplesPerTexel * 4;
+	}
+
+	// Number of distance intervals the occluders of AO rays are sorted into
+	const int ambientOcclusionBins = 8;
+
+	// Ambient occlusion sample of a cosine distributed ray, for a hit distance that is
+	// negative if the ray did not hit anything
+	float getOcclusion(float hitDistance, float maxDistance) {
+		float occlusion(1.0f);
+		if (hitDistance > 0.0f) {
+			float atten = std::max(0.0f, maxDistance - hitDistance) / maxDistance;
+			occlusion = 0.0f + atten * atten;
+		}
+		return occlusion;
+	}
+
+	// Ambient occlusion sample of a ray whose nearest occluder lies in the given interval, as
+	// returned by PathTracer::testOcclusionBinnedStream(). The center of the interval stands
+	// in for the occluder distance.
+	float getBinnedOcclusion(int bin, float maxDistance) {
+		if (bin > ambientOcclusionBins) {
+			return getOcclusion(-1.0f, maxDistance);
+		}
+		return getOcclusion((bin + 0.5f) * maxDistance / ambientOcclusionBins, maxDistance);
+	}
 }
 
 IlluminationBaker::IlluminationBaker(const PathTracer& pathTracer) : pathTracer(&pathTracer) {
@@ -76,47 +337,398 @@ IlluminationBaker::IlluminationBaker(const PathTracer& pathTracer) : pathTracer(
 }
 
 SharedImage IlluminationBaker::bakeIrradiance(const Primitive& primitive, int width, int height, int samplesPerTexel) const {
-	auto values = bake(primitive, width, height, samplesPerTexel, [&](glm::vec3 pos, glm::vec3 normal) {
-		glm::vec3 dir = sampleCosineHemisphere(normal);
-		glm::vec3 irradiance = pathTracer->trace(pos, dir); // dot(N,L) and pdf canceled
-		return irradiance;
-	});
+	return bakeScene({ { &primitive, BakeMapType::Irradiance, width, height, samplesPerTexel } }).front();
+}
 
-	fillIllegalTexels(primitive, width, height, values);
+SharedImage IlluminationBaker::bakeAmbientOcclusion(const Primitive& primitive, int width, int height,
+													int samplesPerTexel, float maxDistance) const {
+	return bakeScene({ { &primitive, BakeMapType::AmbientOcclusion, width, height, samplesPerTexel, maxDistance } }).front();
+}
+
+std::vector<SharedImage> IlluminationBaker::bakeScene(const std::vector<BakeJob>& jobs) const {
+	std::vector<BakeAccumulation> accumulations;
+	bakeSceneProgressive(jobs, std::numeric_limits<int>::max(), accumulations, nullptr);
+	return resolveScene(jobs, accumulations);
+}
+
+void IlluminationBaker::bakeSceneProgressive(const std::vector<BakeJob>& jobs, int samplesPerPass,
+		std::vector<BakeAccumulation>& accumulations, const std::function<bool()>& onPass) const {
+	std::vector<int> combinedJobs;
+	std::vector<int> bufferJobs = getBufferJobs(jobs, combinedJobs);
 
-	SharedImage bakedMap = std::make_shared<Image>(width, height, GL_RGB16F);
-	for (int i = 0; i < width * height; ++i) {
-		bakedMap->getDataPtr<glm::u16vec3>()[i] = glm::packHalf(values[i]);
+	// The path guide and the radiance cache learn from passes that double in size, starting
+	// with one sample per texel, so they keep up with the samples taken so far. They are not
+	// part of the checkpoints and start over with every call, so Main does not resume them.
+	PathGuide* guide = pathTracer->getPathGuide();
+	RadianceCache* radianceCache = pathTracer->getRadianceCache();
+	bool isLearning = guide || radianceCache;
+	int learningPassSamples = 1;
+	if (guide) {
+		guide->clear();
+	}
+	if (radianceCache) {
+		radianceCache->clear();
+	}
+
+	std::vector<SharedTexelGBuffer> gbuffers(jobs.size());
+	std::vector<BakeOperator> operators(jobs.size());
+	std::vector<std::uint32_t> seeds(jobs.size());
+	accumulations.resize(jobs.size());
+
+	for (std::size_t j = 0; j < jobs.size(); ++j) {
+		const BakeJob& job = jobs[j];
+		if (bufferJobs[j] != static_cast<int>(j)) {
+			continue;
+		}
+
+		// Maps of the same primitive with the same resolution share their rasterization
+		for (std::size_t k = 0; k < j && !gbuffers[j]; ++k) {
+			if (jobs[k].primitive == job.primitive && jobs[k].width == job.width && jobs[k].height == job.height) {
+				gbuffers[j] = gbuffers[k];
+			}
+		}
+
+		if (!gbuffers[j]) {
+			gbuffers[j] = getTexelGBuffer(*job.primitive, job.width, job.height);
+		}
+
+		operators[j] = getBakeOperator(job, combinedJobs[j] != -1 ? &jobs[combinedJobs[j]] : nullptr);
+		seeds[j] = getPrimitiveSeed(*job.primitive);
+
+		BakeAccumulation& accumulation = accumulations[j];
+		if (accumulation.sums.empty()) {
+			accumulation.samplesPerTexel = 0;
+			accumulation.sums.assign(job.width * job.height, glm::vec4(0.0f));
+			accumulation.sunSums.assign(job.type != BakeMapType::AmbientOcclusion ? job.width * job.height : 0, glm::vec3(0.0f));
+			accumulation.squareSums.assign(job.width * job.height, glm::vec2(0.0f));
+			accumulation.numSamples.assign(job.width * job.height, 0);
+			accumulation.samplesTaken.assign(job.width * job.height, 0);
+			accumulation.sampleIndices.assign(job.width * job.height, 0);
+		}
+	}
+
+	// With a noise target the passes go on until all texels of a job are within it or have
+	// taken the most samples they may take, however many that are
+	bool isAdaptive = targetRelativeError > 0.0f;
+	std::vector<unsigned char> hasNoisyTexels(jobs.size(), 1);
+
+	while (true) {
+		std::vector<int> passSamples(jobs.size(), 0);
+		for (std::size_t j = 0; j < jobs.size(); ++j) {
+			if (bufferJobs[j] == static_cast<int>(j) && hasNoisyTexels[j]) {
+				int maxSamples = isAdaptive ? getMaxAdaptiveSamples(jobs[j].samplesPerTexel) : jobs[j].samplesPerTexel;
+				passSamples[j] = std::min(isLearning ? std::min(samplesPerPass, learningPassSamples) : samplesPerPass,
+					maxSamples - accumulations[j].samplesPerTexel);
+			}
+		}
+
+		if (std::all_of(passSamples.begin(), passSamples.end(), [](int samples) { return samples <= 0; })) {
+			break;
+		}
+
+		// The texels of all maps are split into small tiles of neighboring texels, which are
+		// pooled into one queue. Each tile is processed with all of its samples by a single
+		// thread and the dynamic schedule lets threads that finish early take over the
+		// remaining tiles, so small maps do not leave threads idle. The tiles with the most
+		// samples are handed out first and the cheap ones fill the gaps at the end.
+		const int texelsPerTile = 16;
+		struct BakeTile {
+			int job;
+			int firstTexel;
+		};
+
+		// Every sample only depends on its texel and sample index, so a shard gives the
+		// same values for its tiles as a bake of the whole scene. This does not hold with a
+		// path guide or radiance cache, which would only learn from the tiles of the shard.
+		std::vector<BakeTile> tiles;
+		int tileIndex = 0;
+		for (std::size_t j = 0; j < jobs.size(); ++j) {
+			if (bufferJobs[j] != static_cast<int>(j)) {
+				continue;
+			}
+
+			for (int firstTexel = 0; firstTexel < gbuffers[j]->getTexelCount(); firstTexel += texelsPerTile) {
+				if (tileIndex++ % shardCount == shardIndex && passSamples[j] > 0) {
+					tiles.push_back({ static_cast<int>(j), firstTexel });
+				}
+			}
+		}
+
+		std::stable_sort(tiles.begin(), tiles.end(), [&](const BakeTile& a, const BakeTile& b) {
+			return passSamples[a.job] > passSamples[b.job];
+		});
+
+		std::vector<unsigned char> isTileNoisy(tiles.size(), 0);
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (int i = 0; i < static_cast<int>(tiles.size()); ++i) {
+			const BakeTile& tile = tiles[i];
+			const TexelGBuffer& gbuffer = *gbuffers[tile.job];
+			int tileSize = std::min(texelsPerTile, gbuffer.getTexelCount() - tile.firstTexel);
+			isTileNoisy[i] = bakeTile(gbuffer, seeds[tile.job], jobs[tile.job].samplesPerTexel, passSamples[tile.job],
+				operators[tile.job], tile.firstTexel, tileSize, accumulations[tile.job]);
+		}
+
+		for (std::size_t j = 0; j < jobs.size(); ++j) {
+			accumulations[j].samplesPerTexel += std::max(passSamples[j], 0);
+			if (isAdaptive) {
+				hasNoisyTexels[j] = 0;
+			}
+		}
+		for (std::size_t i = 0; i < tiles.size(); ++i) {
+			if (isTileNoisy[i]) {
+				hasNoisyTexels[tiles[i].job] = 1;
+			}
+		}
+
+		if (guide) {
+			guide->update();
+		}
+		if (radianceCache) {
+			radianceCache->update();
+		}
+		if (isLearning) {
+			learningPassSamples = learningPassSamples > std::numeric_limits<int>::max() / 2 ? std::numeric_limits<int>::max() : learningPassSamples * 2;
+		}
+
+		if (onPass && !onPass()) {
+			break;
+		}
 	}
-	return bakedMap;
 }
 
-SharedImage IlluminationBaker::bakeAmbientOcclusion(const Primitive& primitive, int width, int height,
-													int samplesPerTexel, float maxDistance) const {
-	auto values = bake(primitive, width, height, samplesPerTexel, [&](glm::vec3 pos, glm::vec3 normal) {
-		glm::vec3 dir = sampleCosineHemisphere(normal);
-		float occlusionDist = pathTracer->testOcclusionDist(pos, dir);
-		float occlusion(1.0f);
-		if (occlusionDist > 0.0f) {
-			float atten = std::max(0.0f, maxDistance - occlusionDist) / maxDistance;
-			occlusion = 0.0f + atten * atten;
+std::vector<SharedImage> IlluminationBaker::resolveScene(const std::vector<BakeJob>& jobs,
+		const std::vector<BakeAccumulation>& accumulations) const {
+	std::vector<int> combinedJobs;
+	std::vector<int> bufferJobs = getBufferJobs(jobs, combinedJobs);
+
+	std::vector<bool> hasSunLayer(jobs.size(), false);
+	for (std::size_t j = 0; j < jobs.size(); ++j) {
+		if (jobs[j].type == BakeMapType::SunIrradiance) {
+			hasSunLayer[bufferJobs[j]] = true;
 		}
-		return glm::vec3(occlusion);
-	});
+	}
+
+	// Every covered texel has at least one sample, so the sample counts double as the
+	// coverage for the dilation. The sun layer is kept in rgb of its own buffer.
+	std::vector<std::vector<glm::vec4>> buffers(jobs.size());
+	std::vector<std::vector<glm::vec4>> sunBuffers(jobs.size());
+	for (std::size_t j = 0; j < jobs.size(); ++j) {
+		const BakeJob& job = jobs[j];
+		if (bufferJobs[j] != static_cast<int>(j)) {
+			continue;
+		}
+
+		const BakeAccumulation& accumulation = accumulations[j];
+		buffers[j].resize(job.width * job.height);
+		for (int i = 0; i < job.width * job.height; ++i) {
+			buffers[j][i] = accumulation.sums[i] / static_cast<float>(std::max<std::uint32_t>(1, accumulation.numSamples[i]));
+		}
+
+		if (hasSunLayer[j]) {
+			sunBuffers[j].resize(job.width * job.height);
+			for (int i = 0; i < job.width * job.height; ++i) {
+				sunBuffers[j][i] = glm::vec4(accumulation.sunSums[i], 0.0f)
+					/ static_cast<float>(std::max<std::uint32_t>(1, accumulation.numSamples[i]));
+			}
+		}
+
+		// Denoised before the dilation, which copies the filtered texels. The sun layer is
+		// filtered with the weights of the irradiance, so that it stays a part of it.
+		if (denoiseIterations > 0) {
+			glm::vec4 luminanceWeights = (job.type == BakeMapType::AmbientOcclusion)
+				? glm::vec4(0.0f, 0.0f, 0.0f, 1.0f) : glm::vec4(0.2126f, 0.7152f, 0.0722f, 0.0f);
+			denoiseLightMap(job.width, job.height, getDenoiserTexels(*job.primitive, job.width, job.height, accumulation.numSamples),
+				luminanceWeights, buffers[j], hasSunLayer[j] ? &sunBuffers[j] : nullptr, denoiseIterations);
+		}
+
+		std::vector<int> nearestLegalTexels = getNearestLegalTexels(job.width, job.height, accumulation.numSamples);
+		fillIllegalTexels(nearestLegalTexels, buffers[j]);
+		if (hasSunLayer[j]) {
+			fillIllegalTexels(nearestLegalTexels, sunBuffers[j]);
+		}
+	}
+
+	// The sun layer is stored for a sun of unit radiance, the runtime scales it by the sun's
+	// color and power
+	glm::vec3 sunRadiance = pathTracer->getSunRadiance();
+	glm::vec3 sunScale = glm::vec3(1.0f) / glm::max(sunRadiance, glm::vec3(1.0e-6f));
+
+	std::vector<SharedImage> bakedMaps;
+	for (std::size_t j = 0; j < jobs.size(); ++j) {
+		const BakeJob& job = jobs[j];
+		const std::vector<glm::vec4>& buffer = buffers[bufferJobs[j]];
+		const std::vector<glm::vec4>& sunBuffer = sunBuffers[bufferJobs[j]];
+
+		if (job.type == BakeMapType::Irradiance) {
+			SharedImage bakedMap = std::make_shared<Image>(job.width, job.height, GL_RGB16F);
+			for (int i = 0; i < job.width * job.height; ++i) {
+				glm::vec3 irradiance = glm::vec3(buffer[i]);
+				if (hasSunLayer[bufferJobs[j]]) {
+					irradiance = glm::max(irradiance - glm::vec3(sunBuffer[i]), glm::vec3(0.0f));
+				}
+				bakedMap->getDataPtr<glm::u16vec3>()[i] = glm::packHalf(irradiance);
+			}
+			bakedMaps.push_back(bakedMap);
+		}
+		else if (job.type == BakeMapType::SunIrradiance) {
+			SharedImage bakedMap = std::make_shared<Image>(job.width, job.height, GL_RGB16F);
+			for (int i = 0; i < job.width * job.height; ++i) {
+				bakedMap->getDataPtr<glm::u16vec3>()[i] = glm::packHalf(glm::vec3(sunBuffer[i]) * sunScale);
+			}
+			bakedMaps.push_back(bakedMap);
+		}
+		else {
+			SharedImage bakedMap = std::make_shared<Image>(job.width, job.height, GL_R16F);
+			for (int i = 0; i < job.width * job.height; ++i) {
+				bakedMap->getDataPtr<glm::uint16>()[i] = glm::packHalf1x16(buffer[i].w);
+			}
+			bakedMaps.push_back(bakedMap);
+		}
+	}
+
+	return bakedMaps;
+}
+
+std::vector<int> IlluminationBaker::getBufferJobs(const std::vector<BakeJob>& jobs, std::vector<int>& combinedJobs) const {
+	// An AO job with the same layout and sample count as an irradiance job of the same
+	// primitive is baked along with it: the first segment of each irradiance path is a
+	// cosine distributed ray and its hit distance gives the AO sample. Its results are
+	// stored in the alpha channel of the irradiance job's accumulation. The sun part of
+	// every irradiance path is accumulated anyway, so a sun irradiance job only needs an
+	// irradiance job to share its buffer with. Guided paths do not start with a cosine
+	// distributed ray, so they bake AO on their own.
+	std::vector<int> bufferJobs(jobs.size());
+	combinedJobs.assign(jobs.size(), -1);
+	for (std::size_t j = 0; j < jobs.size(); ++j) {
+		bufferJobs[j] = static_cast<int>(j);
+		if (jobs[j].type == BakeMapType::SunIrradiance) {
+			for (std::size_t k = 0; k < jobs.size(); ++k) {
+				if (jobs[k].type == BakeMapType::Irradiance && jobs[k].primitive == jobs[j].primitive
+						&& jobs[k].width == jobs[j].width && jobs[k].height == jobs[j].height
+						&& jobs[k].samplesPerTexel == jobs[j].samplesPerTexel) {
+					bufferJobs[j] = static_cast<int>(k);
+					break;
+				}
+			}
+			continue;
+		}
+
+		if (jobs[j].type != BakeMapType::AmbientOcclusion || pathTracer->getPathGuide()) {
+			continue;
+		}
+
+		for (std::size_t k = 0; k < j; ++k) {
+			if (jobs[k].type == BakeMapType::Irradiance && combinedJobs[k] == -1 && jobs[k].primitive == jobs[j].primitive
+					&& jobs[k].width == jobs[j].width && jobs[k].height == jobs[j].height
+					&& jobs[k].samplesPerTexel == jobs[j].samplesPerTexel) {
+				bufferJobs[j] = static_cast<int>(k);
+				combinedJobs[k] = static_cast<int>(j);
+				break;
+			}
+		}
+	}
+
+	return bufferJobs;
+}
+
+IlluminationBaker::BakeOperator IlluminationBaker::getBakeOperator(const BakeJob& job, const BakeJob* combinedJob) const {
+	if (job.type != BakeMapType::AmbientOcclusion) {
+		bool withOcclusion = combinedJob != nullptr;
+		float maxDistance = withOcclusion ? combinedJob->maxDistance : 0.0f;
+		return [this, withOcclusion, maxDistance](std::vector<BakeSample>& samples, std::vector<glm::vec4>& values,
+												  std::vector<glm::vec3>& sunValues) {
+			std::vector<PathTracer::IrradianceSample> irradiance;
+			if (useStreamTracing) {
+				std::vector<glm::vec3> positions(samples.size());
+				std::vector<glm::vec3> normals(samples.size());
+				std::vector<Sampler> samplers;
+				samplers.reserve(samples.size());
+				for (std::size_t i = 0; i < samples.size(); ++i) {
+					positions[i] = samples[i].position;
+					normals[i] = samples[i].normal;
+					samplers.push_back(samples[i].sampler);
+				}
+
+				pathTracer->traceIrradianceStream(positions, normals, samplers, irradiance);
+			}
+			else {
+				irradiance.resize(samples.size());
+				for (std::size_t i = 0; i < samples.size(); ++i) {
+					pathTracer->traceIrradiance(samples[i].position, samples[i].normal, samples[i].sampler, irradiance[i]);
+				}
+			}
 
-	SharedImage bakedMap = std::make_shared<Image>(width, height, GL_R16F);
-	for (int i = 0; i < width * height; ++i) {
-		bakedMap->getDataPtr<glm::uint16>()[i] = glm::packHalf1x16(values[i].x);
+			values.resize(samples.size());
+			sunValues.resize(samples.size());
+			for (std::size_t i = 0; i < samples.size(); ++i) {
+				float occlusion = withOcclusion ? getOcclusion(irradiance[i].firstHitDistance, maxDistance) : 0.0f;
+				values[i] = glm::vec4(irradiance[i].irradiance, occlusion);
+				sunValues[i] = irradiance[i].sunIrradiance;
+			}
+		};
 	}
-	return bakedMap;
+
+	float maxDistance = job.maxDistance;
+	return [this, maxDistance](std::vector<BakeSample>& samples, std::vector<glm::vec4>& values, std::vector<glm::vec3>& sunValues) {
+		std::vector<glm::vec3> positions(samples.size());
+		std::vector<glm::vec3> dirs(samples.size());
+		for (std::size_t i = 0; i < samples.size(); ++i) {
+			positions[i] = samples[i].position;
+			dirs[i] = sampleCosineHemisphere(samples[i].normal, samples[i].sampler.next2D());
+		}
+
+		// The occluder distance is only needed up to the interval it falls into
+		std::vector<int> bins;
+		pathTracer->testOcclusionBinnedStream(positions, dirs, maxDistance, ambientOcclusionBins, bins);
+
+		values.resize(samples.size());
+		sunValues.assign(samples.size(), glm::vec3(0.0f));
+		for (std::size_t i = 0; i < samples.size(); ++i) {
+			values[i] = glm::vec4(0.0f, 0.0f, 0.0f, getBinnedOcclusion(bins[i], maxDistance));
+		}
+	};
 }
 
-std::vector<glm::vec3> IlluminationBaker::bake(const Primitive& primitive, int width, int height,
-											   int samplesPerTexel, const BakeOperator& op) const {
-	std::vector<glm::vec3> buffer(width * height, glm::vec3(0.0f));
-	std::vector<int> numSamples(width * height, 0);
+SharedTexelGBuffer IlluminationBaker::getTexelGBuffer(const Primitive& primitive, int width, int height) const {
+	// Repeated bakes of the same scene, like the passes of a radiosity or time-of-day bake,
+	// keep their G-buffers in memory
+	std::uint64_t key = getTexelGBufferKey(primitive, width, height);
+	auto cached = gbufferCache.find(key);
+	if (cached != gbufferCache.end()) {
+		return cached->second;
+	}
+
+	SharedTexelGBuffer& gbuffer = gbufferCache[key];
+	if (gbufferCacheDirectory.empty()) {
+		gbuffer = rasterizeTexelWork(primitive, width, height);
+		return gbuffer;
+	}
+
+	std::ostringstream path;
+	path << gbufferCacheDirectory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".gbuf";
+
+	gbuffer = TexelGBuffer::loadFromFile(path.str(), key);
+	if (gbuffer) {
+		glow::info() << "Using the cached texel G-buffer " << path.str();
+		return gbuffer;
+	}
+
+	gbuffer = rasterizeTexelWork(primitive, width, height);
+	if (!gbuffer->writeToFile(path.str(), key)) {
+		glow::warning() << "Could not write the texel G-buffer " << path.str();
+	}
+	return gbuffer;
+}
+
+SharedTexelGBuffer IlluminationBaker::rasterizeTexelWork(const Primitive& primitive, int width, int height) const {
 	glm::mat3 normalMatrix = glm::mat3(glm::transpose(glm::inverse(primitive.transform)));
 
+	std::vector<BakeTriangle> triangles;
+	std::vector<TexelWork> work;
+	std::vector<std::uint64_t> texelRanges;
+	triangles.reserve(primitive.indices.size() / 3);
+	std::vector<unsigned int> charts = getLightMapCharts(primitive);
+
 	for (std::size_t i = 0; i < primitive.indices.size(); i += 3) {
 		unsigned int index0 = primitive.indices[i];
 		unsigned int index1 = primitive.indices[i + 1];
@@ -136,148 +748,277 @@ std::vector<glm::vec3> IlluminationBaker::bake(const Primitive& primitive, int w
 		glm::vec2 texel1 = glm::floor(t1 * glm::vec2(width - 1, height - 1)) + glm::vec2(0.5f);
 		glm::vec2 texel2 = glm::floor(t2 * glm::vec2(width - 1, height - 1)) + glm::vec2(0.5f);
 
-		glm::vec3 v0 = primitive.transform * glm::vec4(primitive.positions[index0], 1.0f);
-		glm::vec3 v1 = primitive.transform * glm::vec4(primitive.positions[index1], 1.0f);
-		glm::vec3 v2 = primitive.transform * glm::vec4(primitive.positions[index2], 1.0f);
+		EdgeFunctions edges;
+		if (!setupEdgeFunctions(texel0, texel1, texel2, edges)) {
+			continue;
+		}
 
-		glm::vec3 n0 = glm::normalize(normalMatrix * primitive.normals[index0]);
-		glm::vec3 n1 = glm::normalize(normalMatrix * primitive.normals[index1]);
-		glm::vec3 n2 = glm::normalize(normalMatrix * primitive.normals[index2]);
+		BakeTriangle triangle;
+		triangle.baryDx = edges.dx;
+		triangle.baryDy = edges.dy;
 
-		float minX = std::min(texel0.x, std::min(texel1.x, texel2.x));
-		float minY = std::min(texel0.y, std::min(texel1.y, texel2.y));
-		float maxX = std::max(texel0.x, std::max(texel1.x, texel2.x));
-		float maxY = std::max(texel0.y, std::max(texel1.y, texel2.y));
+		triangle.v0 = primitive.transform * glm::vec4(primitive.positions[index0], 1.0f);
+		triangle.v1 = primitive.transform * glm::vec4(primitive.positions[index1], 1.0f);
+		triangle.v2 = primitive.transform * glm::vec4(primitive.positions[index2], 1.0f);
 
-		int numStepsX = static_cast<int>(maxX) - static_cast<int>(minX) + 1;
-		int numStepsY = static_cast<int>(maxY) - static_cast<int>(minY) + 1;
+		triangle.n0 = glm::normalize(normalMatrix * primitive.normals[index0]);
+		triangle.n1 = glm::normalize(normalMatrix * primitive.normals[index1]);
+		triangle.n2 = glm::normalize(normalMatrix * primitive.normals[index2]);
+		triangle.chart = charts[i / 3];
 
-		for (int sample = 0; sample < samplesPerTexel; ++sample) {
-			#pragma omp parallel for
-			for (int stepY = 0; stepY < numStepsY; ++stepY) {
-				for (int stepX = 0; stepX < numStepsX; ++stepX) {
-					glm::vec2 texelP = glm::vec2(minX, minY) + glm::vec2(stepX, stepY);
-					texelP.x = texelP.x + (uniformDist(randEngine) - 0.5f);
-					texelP.y = texelP.y + (uniformDist(randEngine) - 0.5f);
+		auto triangleIndex = static_cast<unsigned int>(triangles.size());
+		rasterizeTriangle(texel0, texel1, texel2, width, height, true, [&](int x, int y, const glm::vec3& barycentric) {
+			work.push_back({ x + y * width, triangleIndex, barycentric });
+		});
 
-					glm::vec3 bary = getBarycentricCoords(texelP, texel0, texel1, texel2);
-					if (!isPointInTriangle(bary)) {
-						continue;
-					}
+		triangles.push_back(triangle);
+	}
 
-					glm::vec3 worldPos = v0 * bary.x + v1 * bary.y + v2 * bary.z;
-					glm::vec3 worldNormal = glm::normalize(n0 * bary.x + n1 * bary.y + n2 * bary.z);
-					auto value = op(worldPos, worldNormal);
-					
-					int imageX = static_cast<int>(texelP.x);
-					int imageY = static_cast<int>(texelP.y);
-					buffer[imageX + imageY * width] += value;
-					numSamples[imageX + imageY * width]++;
-				}
-			}
+	// Group the work by texel so that every texel is owned by exactly one worker
+	std::stable_sort(work.begin(), work.end(), [](const TexelWork& a, const TexelWork& b) {
+		return a.texelIndex < b.texelIndex;
+	});
+
+	for (std::size_t i = 0; i < work.size(); ++i) {
+		if (i == 0 || work[i].texelIndex != work[i - 1].texelIndex) {
+			texelRanges.push_back(i);
 		}
 	}
+	texelRanges.push_back(work.size());
 
-	for (int k = 0; k < buffer.size(); ++k) {
-		buffer[k] /= static_cast<float>(std::max(1, numSamples[k]));
-	}
+	return std::make_shared<TexelGBuffer>(std::move(triangles), std::move(work), std::move(texelRanges));
+}
 
-	return buffer;
+void IlluminationBaker::setSampleSequence(SampleSequence sequence) {
+	sampleSequence = sequence;
 }
 
-void IlluminationBaker::fillIllegalTexels(const Primitive& primitive, int width, int height, std::vector<glm::vec3>& values) const {
-	std::vector<bool> illegalMap(width * height, true);
+void IlluminationBaker::setUseStreamTracing(bool enabled) {
+	useStreamTracing = enabled;
+}
 
-	for (std::size_t i = 0; i < primitive.indices.size(); i += 3) {
-		unsigned int index0 = primitive.indices[i];
-		unsigned int index1 = primitive.indices[i + 1];
-		unsigned int index2 = primitive.indices[i + 2];
+void IlluminationBaker::setTexelGBufferCacheDirectory(const std::string& directory) {
+	gbufferCacheDirectory = directory;
+}
 
-		glm::vec2 t0 = primitive.lightMapTexCoords[index0];
-		glm::vec2 t1 = primitive.lightMapTexCoords[index1];
-		glm::vec2 t2 = primitive.lightMapTexCoords[index2];
+void IlluminationBaker::setTargetRelativeError(float error) {
+	targetRelativeError = error;
+}
 
-		glm::vec2 texel0 = glm::floor(t0 * glm::vec2(width - 1, height - 1)) + glm::vec2(0.5f);
-		glm::vec2 texel1 = glm::floor(t1 * glm::vec2(width - 1, height - 1)) + glm::vec2(0.5f);
-		glm::vec2 texel2 = glm::floor(t2 * glm::vec2(width - 1, height - 1)) + glm::vec2(0.5f);
+void IlluminationBaker::setShard(int index, int count) {
+	shardIndex = index;
+	shardCount = count;
+}
 
-		float minX = std::min(texel0.x, std::min(texel1.x, texel2.x));
-		float minY = std::min(texel0.y, std::min(texel1.y, texel2.y));
-		float maxX = std::max(texel0.x, std::max(texel1.x, texel2.x));
-		float maxY = std::max(texel0.y, std::max(texel1.y, texel2.y));
-
-		int numStepsX = static_cast<int>(maxX) - static_cast<int>(minX) + 1;
-		int numStepsY = static_cast<int>(maxY) - static_cast<int>(minY) + 1;
-
-		int numSamplesX = 8;
-		int numSamplesY = 8;
-		glm::vec2 offset = glm::vec2(1.0f / numSamplesX, 1.0f / numSamplesY);
-		glm::vec2 stepSize = (glm::vec2(1.0f) - offset * 2.0f) / glm::vec2(numSamplesX, numSamplesY);
-
-		for (int stepY = 0; stepY < numStepsY; ++stepY) {
-			for (int stepX = 0; stepX < numStepsX; ++stepX) {
-				glm::vec2 texelCenter = glm::vec2(minX, minY) + glm::vec2(stepX, stepY);
-				int imageX = static_cast<int>(texelCenter.x);
-				int imageY = static_cast<int>(texelCenter.y);
-
-				for (int y = 0; y < numSamplesY; ++y) {
-					for (int x = 0; x < numSamplesX; ++x) {
-						glm::vec2 samplePoint = texelCenter - glm::vec2(0.5f) + offset + stepSize * glm::vec2(x, y);
-						if (isPointInTriangle(getBarycentricCoords(samplePoint, texel0, texel1, texel2))) {
-							illegalMap[imageX + imageY * width] = false;
-							break;
-						}
-					}
+void IlluminationBaker::setDenoiseIterations(int iterations) {
+	denoiseIterations = iterations;
+}
 
-					if (!illegalMap[imageX + imageY * width]) {
-						break;
+bool IlluminationBaker::bakeTile(const TexelGBuffer& gbuffer, std::uint32_t seed, int samplesPerTexel, int passSamples, const BakeOperator& op,
+								 int firstTexel, int tileSize, BakeAccumulation& accumulation) const {
+	const BakeTriangle* triangles = gbuffer.getTriangles();
+	const TexelWork* work = gbuffer.getWork();
+	const std::uint64_t* texelRanges = gbuffer.getTexelRanges();
+
+	// The samples of a tile are handed to the bake operator in batches, so it can trace
+	// them as a stream
+	const std::size_t maxBatchSize = 4096;
+
+	// Continue from the samples of earlier passes
+	bool withSun = !accumulation.sunSums.empty();
+	std::vector<glm::vec4> values(tileSize);
+	std::vector<glm::vec3> sunValues(tileSize, glm::vec3(0.0f));
+	std::vector<glm::vec2> squareSums(tileSize);
+	std::vector<std::uint32_t> numSamples(tileSize);
+	std::vector<std::uint32_t> samplesTaken(tileSize);
+	std::vector<std::uint32_t> sampleIndices(tileSize);
+	for (int t = 0; t < tileSize; ++t) {
+		int texelIndex = work[texelRanges[firstTexel + t]].texelIndex;
+		values[t] = accumulation.sums[texelIndex];
+		if (withSun) {
+			sunValues[t] = accumulation.sunSums[texelIndex];
+		}
+		squareSums[t] = accumulation.squareSums[texelIndex];
+		numSamples[t] = accumulation.numSamples[texelIndex];
+		samplesTaken[t] = accumulation.samplesTaken[texelIndex];
+		sampleIndices[t] = accumulation.sampleIndices[texelIndex];
+	}
+
+	std::vector<BakeSample> batch;
+	std::vector<glm::vec4> batchValues;
+	std::vector<glm::vec3> batchSunValues;
+	batch.reserve(maxBatchSize);
+
+	auto flush = [&]() {
+		op(batch, batchValues, batchSunValues);
+		for (std::size_t i = 0; i < batch.size(); ++i) {
+			glm::vec2 noiseValues = getNoiseValues(batchValues[i]);
+			values[batch[i].texel] += batchValues[i];
+			sunValues[batch[i].texel] += batchSunValues[i];
+			squareSums[batch[i].texel] += noiseValues * noiseValues;
+			numSamples[batch[i].texel]++;
+		}
+		batch.clear();
+	};
+
+	// Takes counts[i] samples in texel tileTexels[i]
+	auto takeSamples = [&](const std::vector<int>& tileTexels, const std::vector<int>& counts) {
+		int maxCount = counts.empty() ? 0 : *std::max_element(counts.begin(), counts.end());
+		for (std::size_t k = 0; k < tileTexels.size(); ++k) {
+			samplesTaken[tileTexels[k]] += counts[k];
+		}
+
+		for (int sample = 0; sample < maxCount; ++sample) {
+			for (std::size_t k = 0; k < tileTexels.size(); ++k) {
+				if (sample >= counts[k]) {
+					continue;
+				}
+
+				int t = tileTexels[k];
+				int texel = firstTexel + t;
+				int texelIndex = work[texelRanges[texel]].texelIndex;
+				for (std::size_t i = texelRanges[texel]; i < texelRanges[texel + 1]; ++i) {
+					const auto& triangle = triangles[work[i].triangle];
+					Sampler sampler(static_cast<std::uint32_t>(texelIndex), sampleIndices[t]++, seed, sampleSequence);
+
+					glm::vec2 offset = sampler.next2D() - glm::vec2(0.5f);
+					glm::vec3 bary = work[i].barycentric + triangle.baryDx * offset.x + triangle.baryDy * offset.y;
+					if (!isPointInTriangle(bary)) {
+						continue;
 					}
+
+					batch.push_back(makeBakeSample(triangle, bary, sampler, t));
 				}
 			}
+
+			if (batch.size() >= maxBatchSize) {
+				flush();
+			}
+		}
+
+		if (!batch.empty()) {
+			flush();
 		}
+	};
+
+	std::vector<int> tileTexels(tileSize);
+	for (int t = 0; t < tileSize; ++t) {
+		tileTexels[t] = t;
 	}
 
-	for (int y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x) {
-			if (!illegalMap[x + y * width]) {
-				continue;
+	bool hasNoisyTexels = false;
+	if (targetRelativeError <= 0.0f) {
+		takeSamples(tileTexels, std::vector<int>(tileSize, passSamples));
+	}
+	else {
+		// The noise target sets the number of samples of every texel, the fixed count only
+		// bounds it. A texel takes samples until it has a quarter of the fixed count, then
+		// more in rounds of that size while its estimate is not yet within the target error
+		// and it has taken less than four times the fixed count. Each pass takes at most
+		// passSamples of them and the next one continues where it left off.
+		auto minSamples = static_cast<std::uint32_t>(getMinAdaptiveSamples(samplesPerTexel));
+		auto maxSamples = static_cast<std::uint32_t>(getMaxAdaptiveSamples(samplesPerTexel));
+		auto isNoisy = [&](int t) {
+			return samplesTaken[t] < maxSamples && (samplesTaken[t] < minSamples
+				|| getRelativeError(numSamples[t], getNoiseValues(values[t]), squareSums[t]) > targetRelativeError);
+		};
+
+		std::vector<std::uint32_t> passBudgets(tileSize, static_cast<std::uint32_t>(passSamples));
+		while (true) {
+			std::vector<int> noisyTexels;
+			std::vector<int> counts;
+			for (int t = 0; t < tileSize; ++t) {
+				if (passBudgets[t] > 0 && isNoisy(t)) {
+					std::uint32_t count = samplesTaken[t] < minSamples ? minSamples - samplesTaken[t] : minSamples;
+					count = std::min(count, std::min(passBudgets[t], maxSamples - samplesTaken[t]));
+					noisyTexels.push_back(t);
+					counts.push_back(static_cast<int>(count));
+					passBudgets[t] -= count;
+				}
 			}
 
-			glm::ivec2 legalCoord = findClosestLegalTexel(x, y, width, height, illegalMap);
-			if (legalCoord.x != -1 && legalCoord.y != -1) {
-				values[x + y * width] = values[legalCoord.x + legalCoord.y * width];
+			if (noisyTexels.empty()) {
+				break;
 			}
+
+			takeSamples(noisyTexels, counts);
+		}
+
+		for (int t = 0; t < tileSize && !hasNoisyTexels; ++t) {
+			hasNoisyTexels = isNoisy(t);
+		}
+	}
+
+	// Conservatively covered texels can be missed by all samples if only a sliver of a
+	// triangle overlaps them. They get a single sample at the texel center clamped into
+	// the triangle, so that they are not left black.
+	for (int t = 0; t < tileSize; ++t) {
+		if (numSamples[t] == 0) {
+			const auto& record = work[texelRanges[firstTexel + t]];
+			glm::vec3 bary = glm::max(record.barycentric, glm::vec3(0.0f));
+			bary /= bary.x + bary.y + bary.z;
+			Sampler sampler(static_cast<std::uint32_t>(record.texelIndex), sampleIndices[t]++, seed, sampleSequence);
+			batch.push_back(makeBakeSample(triangles[record.triangle], bary, sampler, t));
+		}
+	}
+
+	if (!batch.empty()) {
+		flush();
+	}
+
+	for (int t = 0; t < tileSize; ++t) {
+		int texelIndex = work[texelRanges[firstTexel + t]].texelIndex;
+		accumulation.sums[texelIndex] = values[t];
+		if (withSun) {
+			accumulation.sunSums[texelIndex] = sunValues[t];
 		}
+		accumulation.squareSums[texelIndex] = squareSums[t];
+		accumulation.numSamples[texelIndex] = numSamples[t];
+		accumulation.samplesTaken[texelIndex] = samplesTaken[t];
+		accumulation.sampleIndices[texelIndex] = sampleIndices[t];
 	}
+	return hasNoisyTexels;
 }
 
-glm::ivec2 IlluminationBaker::findClosestLegalTexel(int x, int y, int width, int height, const std::vector<bool>& illegalMap) const {
-	glm::ivec2 offsets[] = {
-		{ -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 }, // Distance = 1 * offsetScale
-		{ -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 } // Distance = sqrt(2) * offsetScale
-	};
-	int offsetScale = 1;
-
-	bool isOutOfBounds = false;
-	while (!isOutOfBounds) {
-		for (auto offset : offsets) {
-			glm::ivec2 coord = glm::ivec2(x, y) + offset * offsetScale;
-			if ((coord.x < 0 || coord.x >= width) && (coord.y < 0 || coord.y >= height)) {
-				isOutOfBounds = true;
-				continue;
-			}
+IlluminationBaker::BakeSample IlluminationBaker::makeBakeSample(const BakeTriangle& triangle, const glm::vec3& barycentric,
+																const Sampler& sampler, int texel) const {
+	glm::vec3 worldPos = triangle.v0 * barycentric.x + triangle.v1 * barycentric.y + triangle.v2 * barycentric.z;
+	glm::vec3 worldNormal = glm::normalize(triangle.n0 * barycentric.x + triangle.n1 * barycentric.y + triangle.n2 * barycentric.z);
+	return { worldPos, worldNormal, sampler, texel };
+}
 
-			coord.x = std::max(0, std::min(width - 1, coord.x));
-			coord.y = std::max(0, std::min(height - 1, coord.y));
-			isOutOfBounds = false;
+std::vector<DenoiserTexel> IlluminationBaker::getDenoiserTexels(const Primitive& primitive, int width, int height,
+																 const std::vector<std::uint32_t>& numSamples) const {
+	SharedTexelGBuffer gbuffer = getTexelGBuffer(primitive, width, height);
+	const BakeTriangle* triangles = gbuffer->getTriangles();
+	const TexelWork* work = gbuffer->getWork();
+	const std::uint64_t* texelRanges = gbuffer->getTexelRanges();
 
-			if (!illegalMap[coord.x + coord.y * width]) {
-				return coord;
+	std::vector<DenoiserTexel> texels(width * height, { glm::vec3(0.0f), glm::vec3(0.0f), -1 });
+	for (int texel = 0; texel < gbuffer->getTexelCount(); ++texel) {
+		// Texels without samples, like those of other shards, are left to the dilation
+		int texelIndex = work[texelRanges[texel]].texelIndex;
+		if (numSamples[texelIndex] == 0) {
+			continue;
+		}
+
+		// The texel center on the triangle that covers it the most, moved onto the triangle
+		std::size_t best = texelRanges[texel];
+		for (std::size_t i = texelRanges[texel] + 1; i < texelRanges[texel + 1]; ++i) {
+			if (glm::min(work[i].barycentric.x, glm::min(work[i].barycentric.y, work[i].barycentric.z))
+					> glm::min(work[best].barycentric.x, glm::min(work[best].barycentric.y, work[best].barycentric.z))) {
+				best = i;
 			}
 		}
 
-		offsetScale++;
-	}
+		const BakeTriangle& triangle = triangles[work[best].triangle];
+		glm::vec3 barycentric = glm::max(work[best].barycentric, glm::vec3(0.0f));
+		barycentric /= barycentric.x + barycentric.y + barycentric.z;
 
-	return glm::ivec2(-1);
+		DenoiserTexel& denoiserTexel = texels[texelIndex];
+		denoiserTexel.position = triangle.v0 * barycentric.x + triangle.v1 * barycentric.y + triangle.v2 * barycentric.z;
+		denoiserTexel.normal = glm::normalize(triangle.n0 * barycentric.x + triangle.n1 * barycentric.y + triangle.n2 * barycentric.z);
+		denoiserTexel.chart = static_cast<int>(triangle.chart);
+	}
+	return texels;
 }
@@ -1,14 +1,48 @@
 #pragma once
 
 #include "Image.hh"
+#include "LightMapDenoiser.hh"
+#include "Sampler.hh"
+#include "TexelGBuffer.hh"
 
 #include <glm/glm.hpp>
 #include <vector>
 #include <functional>
+#include <string>
+#include <unordered_map>
 
 class PathTracer;
 class Primitive;
 
+enum class BakeMapType {
+	Irradiance,
+	AmbientOcclusion,
+	SunIrradiance // The irradiance due to the sun alone, for a sun with unit radiance
+};
+
+// A light map of a primitive that is baked as part of a scene
+struct BakeJob {
+	const Primitive* primitive;
+	BakeMapType type;
+	int width;
+	int height;
+	int samplesPerTexel;
+	float maxDistance = 0.0f; // Only used for ambient occlusion
+};
+
+// Samples of a bake job accumulated over the passes of a progressive bake, per texel. A job
+// that is baked along with another one keeps its samples in the accumulation of that job
+// and has an empty one.
+struct BakeAccumulation {
+	int samplesPerTexel = 0; // Taken in all passes so far, the most of any texel with a noise target
+	std::vector<glm::vec4> sums;
+	std::vector<glm::vec3> sunSums; // Part of the irradiance in sums that was emitted by the sun
+	std::vector<glm::vec2> squareSums; // Of the luminance of the irradiance and of the ambient occlusion
+	std::vector<std::uint32_t> numSamples;
+	std::vector<std::uint32_t> samplesTaken; // Per texel, some of which miss the geometry
+	std::vector<std::uint32_t> sampleIndices; // Index of the next sample
+};
+
 class IlluminationBaker {
 public:
 	IlluminationBaker(const PathTracer& pathTracer);
@@ -16,12 +50,76 @@ public:
 	SharedImage bakeIrradiance(const Primitive& primitive, int width, int height, int samplesPerTexel) const;
 	SharedImage bakeAmbientOcclusion(const Primitive& primitive, int width, int height, int samplesPerTexel, float maxDistance) const;
 
+	// Bakes all jobs at once with the texels of all maps sharing one work queue. Returns
+	// the maps in the order of the jobs. Irradiance, sun irradiance and ambient occlusion
+	// maps of a primitive with the same resolution and sample count share their rays. An
+	// irradiance map that shares its rays with a sun irradiance map only holds the rest
+	// of the light, so that the sun can be rescaled at runtime.
+	std::vector<SharedImage> bakeScene(const std::vector<BakeJob>& jobs) const;
+
+	// Takes the samples of the jobs in passes of at most samplesPerPass per texel and adds
+	// them to the accumulations, which may hold the passes of an earlier run. onPass is
+	// called after every pass and ends the bake early by returning false. With a path guide
+	// or a radiance cache the passes also take at most 1, 2, 4, ... samples per texel, and
+	// both start empty and learn from each pass for the next. With a noise target the passes
+	// go on until no texel is above it, see setTargetRelativeError().
+	void bakeSceneProgressive(const std::vector<BakeJob>& jobs, int samplesPerPass,
+		std::vector<BakeAccumulation>& accumulations, const std::function<bool()>& onPass) const;
+	std::vector<SharedImage> resolveScene(const std::vector<BakeJob>& jobs, const std::vector<BakeAccumulation>& accumulations) const;
+
+	void setSampleSequence(SampleSequence sequence);
+	void setUseStreamTracing(bool enabled);
+
+	// Caches the rasterized light map layout of each primitive in the given directory,
+	// so that bakes of unchanged geometry can skip the rasterization
+	void setTexelGBufferCacheDirectory(const std::string& directory);
+
+	// With a positive target, the texels take samples until their 95% confidence interval is
+	// within the target relative error. The sample count of a map only bounds this: every
+	// texel takes at least a quarter of it (16 or more) and at most four times as much. The
+	// statistics of the texels are kept in the accumulations, so a texel stops at the target
+	// over all passes of a progressive bake. Zero takes the same number of samples everywhere.
+	void setTargetRelativeError(float error);
+
+	// Restricts the bakes to the tiles of one of count shards. The tiles are dealt out to the
+	// shards in a fixed order, so the accumulations of all shards add up to a full bake.
+	void setShard(int index, int count);
+
+	// Filters the resolved maps with that many iterations of an edge-avoiding à-trous
+	// filter, guided by the position, normal and chart of every texel. Zero turns it off.
+	void setDenoiseIterations(int iterations);
+
 private:
-	using BakeOperator = std::function<glm::vec3(glm::vec3, glm::vec3)>;
+	struct BakeSample {
+		glm::vec3 position;
+		glm::vec3 normal;
+		Sampler sampler;
+		int texel; // Index of the texel in the current tile
+	};
+
+	// Computes the values of a batch of samples, irradiance in rgb and ambient occlusion in alpha,
+	// and the part of the irradiance that was emitted by the sun
+	using BakeOperator = std::function<void(std::vector<BakeSample>&, std::vector<glm::vec4>&, std::vector<glm::vec3>&)>;
 
-	std::vector<glm::vec3> bake(const Primitive& primitive, int width, int height, int samplesPerTexel, const BakeOperator& op) const;
-	void fillIllegalTexels(const Primitive& primitive, int width, int height, std::vector<glm::vec3>& values) const;
-	glm::ivec2 findClosestLegalTexel(int x, int y, int width, int height, const std::vector<bool>& illegalMap) const;
+	SharedTexelGBuffer getTexelGBuffer(const Primitive& primitive, int width, int height) const;
+	SharedTexelGBuffer rasterizeTexelWork(const Primitive& primitive, int width, int height) const;
+	std::vector<int> getBufferJobs(const std::vector<BakeJob>& jobs, std::vector<int>& combinedJobs) const;
+	BakeOperator getBakeOperator(const BakeJob& job, const BakeJob* combinedJob) const;
+	// Takes passSamples more samples in every texel of the tile, or up to that many in the
+	// texels above the noise target. Returns whether any of those is left.
+	bool bakeTile(const TexelGBuffer& gbuffer, std::uint32_t seed, int samplesPerTexel, int passSamples, const BakeOperator& op,
+		int firstTexel, int tileSize, BakeAccumulation& accumulation) const;
+	BakeSample makeBakeSample(const BakeTriangle& triangle, const glm::vec3& barycentric, const Sampler& sampler, int texel) const;
+	std::vector<DenoiserTexel> getDenoiserTexels(const Primitive& primitive, int width, int height, const std::vector<std::uint32_t>& numSamples) const;
 
 	const PathTracer* pathTracer;
+	SampleSequence sampleSequence = SampleSequence::Sobol;
+	bool useStreamTracing = true;
+	std::string gbufferCacheDirectory;
+	float targetRelativeError = 0.0f;
+	int shardIndex = 0;
+	int shardCount = 1;
+	int denoiseIterations = 0;
+
+	mutable std::unordered_map<std::uint64_t, SharedTexelGBuffer> gbufferCache;
 };
@@ -5,9 +5,26 @@
 #include <glow/data/TextureData.hh>
 #include <glow/objects/Texture2D.hh>
 #include <glm/common.hpp>
+#include <glm/gtc/packing.hpp>
 
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
+
+namespace {
+	float loadChannel(float value, float scale) {
+		return value * scale;
+	}
+
+	float loadChannel(unsigned char value, float scale) {
+		return value * scale;
+	}
+
+	// Half floats are stored as their raw 16 bit pattern
+	float loadChannel(std::uint16_t value, float) {
+		return glm::unpackHalf1x16(value);
+	}
+}
 
 Image::Image(int width, int height, GLenum format)
 		: width(width), height(height), format(format) {
@@ -22,6 +39,11 @@ Image::Image(int width, int height, GLenum format)
 		bitsPerPixel = 16;
 		break;
 
+	case GL_R32F:
+		channels = 1;
+		bitsPerPixel = 32;
+		break;
+
 	case GL_RGB:
 	case GL_RGB8:
 	case GL_SRGB:
@@ -94,6 +116,55 @@ const unsigned char* Image::getDataPtr() const {
 	return data.data();
 }
 
+std::vector<unsigned char> Image::getRowMajorData() const {
+	if (layout == ImageLayout::RowMajor) {
+		return data;
+	}
+
+	std::size_t bytesPerPixel = bitsPerPixel / 8;
+	std::vector<unsigned char> rowMajor(width * height * bytesPerPixel);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			std::copy_n(&data[getTexelIndex(x, y) * bytesPerPixel], bytesPerPixel,
+				&rowMajor[(x + static_cast<std::size_t>(y) * width) * bytesPerPixel]);
+		}
+	}
+	return rowMajor;
+}
+
+void Image::setLayout(ImageLayout layout) {
+	if (layout == this->layout) {
+		return;
+	}
+
+	std::vector<unsigned char> rowMajor = getRowMajorData();
+	this->layout = layout;
+	tilesPerRow = (width + 3) / 4;
+
+	std::size_t bytesPerPixel = bitsPerPixel / 8;
+	if (layout == ImageLayout::RowMajor) {
+		data = std::move(rowMajor);
+	}
+	else {
+		// Tiles at the right and bottom border are padded
+		data.assign(static_cast<std::size_t>(tilesPerRow) * ((height + 3) / 4) * 16 * bytesPerPixel, 0);
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				std::copy_n(&rowMajor[(x + static_cast<std::size_t>(y) * width) * bytesPerPixel], bytesPerPixel,
+					&data[getTexelIndex(x, y) * bytesPerPixel]);
+			}
+		}
+	}
+
+	for (auto& level : mipLevels) {
+		level->setLayout(layout);
+	}
+}
+
+ImageLayout Image::getLayout() const {
+	return layout;
+}
+
 void Image::setWrapMode(GLenum wrapS, GLenum wrapT) {
 	this->wrapS = wrapS;
 	this->wrapT = wrapT;
@@ -108,47 +179,132 @@ GLenum Image::getWrapT() const {
 }
 
 glm::vec4 Image::sample(glm::vec2 uv) const {
+	switch (format) {
+	case GL_R32F:
+		return sampleBilinear<float, 1>(uv, 1.0f);
+	case GL_RGB32F:
+		return sampleBilinear<float, 3>(uv, 1.0f);
+	case GL_RGBA32F:
+		return sampleBilinear<float, 4>(uv, 1.0f);
+	case GL_R16F:
+		return sampleBilinear<std::uint16_t, 1>(uv, 1.0f);
+	case GL_RGB16F:
+		return sampleBilinear<std::uint16_t, 3>(uv, 1.0f);
+	case GL_RGBA16F:
+		return sampleBilinear<std::uint16_t, 4>(uv, 1.0f);
+	default:
+		break;
+	}
+
+	switch (channels) {
+	case 1:
+		return sampleBilinear<unsigned char, 1>(uv, 1.0f / 255.0f);
+	case 3:
+		return sampleBilinear<unsigned char, 3>(uv, 1.0f / 255.0f);
+	default:
+		return sampleBilinear<unsigned char, 4>(uv, 1.0f / 255.0f);
+	}
+}
+
+glm::vec4 Image::sample(glm::vec2 uv, float lod) const {
+	if (!(lod > 0.0f) || mipLevels.empty()) {
+		return sample(uv);
+	}
+
+	int maxLevel = static_cast<int>(mipLevels.size());
+	if (lod >= maxLevel) {
+		return mipLevels.back()->sample(uv);
+	}
+
+	int level = static_cast<int>(lod);
+	const Image& fine = (level == 0) ? *this : *mipLevels[level - 1];
+	const Image& coarse = *mipLevels[level];
+	return glm::mix(fine.sample(uv), coarse.sample(uv), lod - level);
+}
+
+void Image::generateMipmaps() {
+	mipLevels.clear();
+	if (bitsPerPixel != channels * 32) {
+		glow::error() << "Mipmaps can only be generated for float images";
+		return;
+	}
+
+	const Image* source = this;
+	while (source->width > 1 || source->height > 1) {
+		int w = std::max(source->width / 2, 1);
+		int h = std::max(source->height / 2, 1);
+		auto level = std::make_shared<Image>(w, h, format);
+		level->setWrapMode(wrapS, wrapT);
+		level->setLayout(layout);
+
+		const float* src = source->getDataPtr<float>();
+		float* dst = level->getDataPtr<float>();
+		for (int y = 0; y < h; ++y) {
+			int y0 = std::min(y * 2, source->height - 1);
+			int y1 = std::min(y * 2 + 1, source->height - 1);
+			for (int x = 0; x < w; ++x) {
+				int x0 = std::min(x * 2, source->width - 1);
+				int x1 = std::min(x * 2 + 1, source->width - 1);
+				std::size_t index00 = source->getTexelIndex(x0, y0) * channels;
+				std::size_t index10 = source->getTexelIndex(x1, y0) * channels;
+				std::size_t index01 = source->getTexelIndex(x0, y1) * channels;
+				std::size_t index11 = source->getTexelIndex(x1, y1) * channels;
+				std::size_t dstIndex = level->getTexelIndex(x, y) * channels;
+				for (int c = 0; c < channels; ++c) {
+					dst[dstIndex + c] = (src[index00 + c] + src[index10 + c] + src[index01 + c] + src[index11 + c]) * 0.25f;
+				}
+			}
+		}
+
+		mipLevels.push_back(level);
+		source = level.get();
+	}
+}
+
+int Image::getMipLevelCount() const {
+	return static_cast<int>(mipLevels.size()) + 1;
+}
+
+template <typename T, int Channels>
+glm::vec4 Image::sampleBilinear(glm::vec2 uv, float scale) const {
 	if (std::abs(uv.x) > 1.0f && wrapS == GL_REPEAT) uv.x = std::fmod(uv.x, 1.0f);
 	if (std::abs(uv.y) > 1.0f && wrapT == GL_REPEAT) uv.y = std::fmod(uv.y, 1.0f);
 	if (uv.x < 0.0f) uv.x += 1.0f;
 	if (uv.y < 0.0f) uv.y += 1.0f;
+	uv = glm::clamp(uv, 0.0f, 1.0f);
 
-	glm::ivec2 coord00 = glm::ivec2(uv.x * (width - 1), uv.y * (height - 1));
+	glm::vec2 coord = uv * glm::vec2(width - 1, height - 1);
+	glm::ivec2 coord00 = glm::ivec2(coord);
 	glm::ivec2 coord10 = glm::ivec2(std::min(coord00.x + 1, width - 1), coord00.y);
 	glm::ivec2 coord01 = glm::ivec2(coord00.x, std::min(coord00.y + 1, height - 1));
 	glm::ivec2 coord11 = glm::ivec2(coord10.x, coord01.y);
 
-	std::size_t index00 = (coord00.x + (height - coord00.y - 1) * width) * channels;
-	std::size_t index10 = (coord10.x + (height - coord10.y - 1) * width) * channels;
-	std::size_t index01 = (coord01.x + (height - coord01.y - 1) * width) * channels;
-	std::size_t index11 = (coord11.x + (height - coord11.y - 1) * width) * channels;
+	std::size_t index00 = getTexelIndex(coord00.x, height - coord00.y - 1) * Channels;
+	std::size_t index10 = getTexelIndex(coord10.x, height - coord10.y - 1) * Channels;
+	std::size_t index01 = getTexelIndex(coord01.x, height - coord01.y - 1) * Channels;
+	std::size_t index11 = getTexelIndex(coord11.x, height - coord11.y - 1) * Channels;
 
 	glm::vec4 color00(0.0f);
 	glm::vec4 color10(0.0f);
 	glm::vec4 color01(0.0f);
 	glm::vec4 color11(0.0f);
 
-    float scale = 1.0f / 255.0f;
-    if (format == GL_RGB16F || format == GL_RGBA16F || format == GL_RGB32F || format == GL_RGBA32F) {
-        scale = 1.0f;
-    }
-    
-	for (int i = 0; i < channels; ++i) color00[i] = getDataPtr<unsigned char>()[index00 + i] * scale;
-	for (int i = 0; i < channels; ++i) color10[i] = getDataPtr<unsigned char>()[index10 + i] * scale;
-	for (int i = 0; i < channels; ++i) color01[i] = getDataPtr<unsigned char>()[index01 + i] * scale;
-	for (int i = 0; i < channels; ++i) color11[i] = getDataPtr<unsigned char>()[index11 + i] * scale;
+	const T* texels = getDataPtr<T>();
+	for (int i = 0; i < Channels; ++i) color00[i] = loadChannel(texels[index00 + i], scale);
+	for (int i = 0; i < Channels; ++i) color10[i] = loadChannel(texels[index10 + i], scale);
+	for (int i = 0; i < Channels; ++i) color01[i] = loadChannel(texels[index01 + i], scale);
+	for (int i = 0; i < Channels; ++i) color11[i] = loadChannel(texels[index11 + i], scale);
 
-	float dx = uv.x * width - coord00.x;
-	float dy = uv.y * height - coord00.y;
+	float dx = coord.x - coord00.x;
+	float dy = coord.y - coord00.y;
 
 	return glm::mix(glm::mix(color00, color10, dx), glm::mix(color01, color11, dx), dy);
 }
 
-
 glow::SharedTexture2D Image::createTexture() const {
 	auto surface = std::make_shared<glow::SurfaceData>();
-	auto dataPtr = getDataPtr<char>();
-	surface->setData(std::vector<char>(dataPtr, dataPtr + width * height * bitsPerPixel / 8));
+	auto rowMajor = getRowMajorData();
+	surface->setData(std::vector<char>(rowMajor.begin(), rowMajor.end()));
 	surface->setMipmapLevel(0);
 	surface->setWidth(width);
 	surface->setHeight(height);
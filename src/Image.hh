@@ -6,6 +6,11 @@
 #include <vector>
 #include <memory>
 
+enum class ImageLayout {
+	RowMajor, // Rows stored one after another, as expected by OpenGL and the file formats
+	Tiled // 4x4 texel tiles in row-major order, so bilinear neighbours share cache lines
+};
+
 class Image {
 public:
     Image(int width, int height, GLenum format = GL_SRGB);
@@ -15,8 +20,22 @@ public:
 	int getChannels() const;
 	int getBitsPerPixel() const;
     GLenum getFormat() const;
+
+	// The raw data is stored in the current layout, use getTexelIndex() to address it
 	unsigned char* getDataPtr();
 	const unsigned char* getDataPtr() const;
+	std::vector<unsigned char> getRowMajorData() const;
+
+	void setLayout(ImageLayout layout);
+	ImageLayout getLayout() const;
+
+	std::size_t getTexelIndex(int x, int y) const {
+		if (layout == ImageLayout::RowMajor) {
+			return static_cast<std::size_t>(x) + static_cast<std::size_t>(y) * width;
+		}
+		std::size_t tile = static_cast<std::size_t>(y >> 2) * tilesPerRow + (x >> 2);
+		return tile * 16 + ((y & 3) << 2) + (x & 3);
+	}
 
 	void setWrapMode(GLenum wrapS, GLenum wrapT);
 	GLenum getWrapS() const;
@@ -34,27 +53,38 @@ public:
 
 	template <typename T>
 	void setPixel(glm::uvec2 coord, T value) {
-		getDataPtr<T>()[coord.x + coord.y * width] = value;
+		getDataPtr<T>()[getTexelIndex(coord.x, coord.y)] = value;
 	}
 
 	template <typename T>
 	T getPixel(glm::uvec2 coord) const {
-		return getDataPtr<T>()[coord.x + coord.y * width];
+		return getDataPtr<T>()[getTexelIndex(coord.x, coord.y)];
 	}
 
 	glm::vec4 sample(glm::vec2 uv) const;
+	glm::vec4 sample(glm::vec2 uv, float lod) const;
+
+	// Box filtered mip chain for float images, used by sample(uv, lod)
+	void generateMipmaps();
+	int getMipLevelCount() const;
 
 	glow::SharedTexture2D createTexture() const;
 
 private:
+	template <typename T, int Channels>
+	glm::vec4 sampleBilinear(glm::vec2 uv, float scale) const;
+
 	int width;
 	int height;
 	int channels;
 	int bitsPerPixel;
 	GLenum format;
+	ImageLayout layout = ImageLayout::RowMajor;
+	int tilesPerRow = 0;
 	std::vector<unsigned char> data;
 	GLenum wrapS = GL_REPEAT;
 	GLenum wrapT = GL_REPEAT;
+	std::vector<std::shared_ptr<Image>> mipLevels; // Levels 1 to n
 };
 
 using SharedImage = std::shared_ptr<Image>;
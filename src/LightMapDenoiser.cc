@@ -0,0 +1,263 @@
+#include "LightMapDenoiser.hh"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+	// B3 spline, the taps of a row or column at -2 to 2 steps
+	const float kernelWeights[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+	// Tolerances of the edge-stopping functions: the distance to the tangent plane in world
+	// space texel sizes per step and the luminance difference in standard deviations of the
+	// noise. Normals are compared with the 32nd power of their dot product.
+	const float planeSigma = 1.0f;
+	const float luminanceSigma = 4.0f;
+	const float minLuminanceDeviation = 1.0e-4f;
+
+	// max(x, 0) without a branch. With std::max the compiler moves the multiplies that follow
+	// into a branch, which keeps the loops over the texels of a row from vectorizing.
+	inline float clampToPositive(float x) {
+		return 0.5f * (x + std::abs(x));
+	}
+
+	// (1 - x / 16)^16, close to exp(-x) and zero from 16 on. Unlike std::exp it is only
+	// multiplies, so it vectorizes as well.
+	const float maxStopDistance = 16.0f;
+
+	inline float getStopWeight(float x) {
+		float t = clampToPositive(1.0f - x * (1.0f / maxStopDistance));
+		t *= t;
+		t *= t;
+		t *= t;
+		t *= t;
+		return t;
+	}
+
+	inline float getNormalWeight(float cosine) {
+		float t = clampToPositive(cosine);
+		t *= t;
+		t *= t;
+		t *= t;
+		t *= t;
+		t *= t;
+		return t;
+	}
+
+	// Mean distance between horizontal neighbors of the same chart in world space
+	float getWorldTexelSize(int width, int height, const std::vector<DenoiserTexel>& texels) {
+		double sum = 0.0;
+		long long count = 0;
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x + 1 < width; ++x) {
+				const DenoiserTexel& a = texels[x + y * width];
+				const DenoiserTexel& b = texels[x + 1 + y * width];
+				if (a.chart >= 0 && a.chart == b.chart) {
+					sum += glm::length(b.position - a.position);
+					++count;
+				}
+			}
+		}
+		return count > 0 ? static_cast<float>(sum / count) : 0.0f;
+	}
+}
+
+void denoiseLightMap(int width, int height, const std::vector<DenoiserTexel>& texels, const glm::vec4& luminanceWeights,
+					 std::vector<glm::vec4>& values, std::vector<glm::vec4>* linkedValues, int iterations) {
+	float texelSize = getWorldTexelSize(width, height, texels);
+	if (!(texelSize > 0.0f) || iterations <= 0) {
+		return;
+	}
+
+	// The guide and the values are kept as one array per component, so that the texels of a
+	// row are contiguous in every component and the taps of a whole row are added at once
+	int numTexels = width * height;
+	std::vector<float> positions[3];
+	std::vector<float> normals[3];
+	for (int c = 0; c < 3; ++c) {
+		positions[c].resize(numTexels);
+		normals[c].resize(numTexels);
+	}
+	std::vector<int> charts(numTexels);
+	for (int i = 0; i < numTexels; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			positions[c][i] = texels[i].position[c];
+			normals[c][i] = texels[i].normal[c];
+		}
+		charts[i] = texels[i].chart;
+	}
+
+	std::vector<glm::vec4>* maps[2] = { &values, linkedValues };
+	int numMaps = linkedValues ? 2 : 1;
+	int numChannels = 4 * numMaps;
+	std::vector<std::vector<float>> channels(numChannels, std::vector<float>(numTexels));
+	std::vector<std::vector<float>> filtered(numChannels, std::vector<float>(numTexels));
+	for (int m = 0; m < numMaps; ++m) {
+		for (int i = 0; i < numTexels; ++i) {
+			for (int c = 0; c < 4; ++c) {
+				channels[m * 4 + c][i] = (*maps[m])[i][c];
+			}
+		}
+	}
+
+	std::vector<float> luminance(numTexels);
+	auto updateLuminance = [&]() {
+		#pragma omp parallel for
+		for (int i = 0; i < numTexels; ++i) {
+			luminance[i] = channels[0][i] * luminanceWeights.x + channels[1][i] * luminanceWeights.y
+				+ channels[2][i] * luminanceWeights.z + channels[3][i] * luminanceWeights.w;
+		}
+	};
+	updateLuminance();
+
+	// The noise of a texel starts out as the variance of the luminance in its 3x3 neighborhood
+	// and is filtered along with the values, with the squared weights
+	std::vector<float> variance(numTexels, 0.0f);
+	std::vector<float> nextVariance(numTexels);
+	#pragma omp parallel for
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			int p = x + y * width;
+			if (charts[p] < 0) {
+				continue;
+			}
+
+			float sum = 0.0f;
+			float sumSquares = 0.0f;
+			int count = 0;
+			for (int qy = std::max(y - 1, 0); qy <= std::min(y + 1, height - 1); ++qy) {
+				for (int qx = std::max(x - 1, 0); qx <= std::min(x + 1, width - 1); ++qx) {
+					int q = qx + qy * width;
+					if (charts[q] == charts[p]) {
+						sum += luminance[q];
+						sumSquares += luminance[q] * luminance[q];
+						++count;
+					}
+				}
+			}
+
+			float mean = sum / count;
+			variance[p] = std::max(0.0f, sumSquares / count - mean * mean);
+		}
+	}
+
+	for (int iteration = 0; iteration < iterations; ++iteration) {
+		int step = 1 << iteration;
+		float planeScale = 1.0f / (planeSigma * texelSize * step);
+
+		#pragma omp parallel
+		{
+			std::vector<float> weights(width);
+			std::vector<float> weightSums(width);
+			std::vector<float> varianceSums(width);
+			std::vector<float> luminanceScales(width);
+			std::vector<std::vector<float>> sums(numChannels, std::vector<float>(width));
+
+			#pragma omp for
+			for (int y = 0; y < height; ++y) {
+				int row = y * width;
+				std::fill(weightSums.begin(), weightSums.end(), 0.0f);
+				std::fill(varianceSums.begin(), varianceSums.end(), 0.0f);
+				for (auto& sum : sums) {
+					std::fill(sum.begin(), sum.end(), 0.0f);
+				}
+				for (int x = 0; x < width; ++x) {
+					luminanceScales[x] = 1.0f / (luminanceSigma * std::sqrt(variance[row + x]) + minLuminanceDeviation);
+				}
+
+				const float* px = positions[0].data() + row;
+				const float* py = positions[1].data() + row;
+				const float* pz = positions[2].data() + row;
+				const float* nx = normals[0].data() + row;
+				const float* ny = normals[1].data() + row;
+				const float* nz = normals[2].data() + row;
+				const int* chart = charts.data() + row;
+				const float* lum = luminance.data() + row;
+				const float* scale = luminanceScales.data();
+				float* w = weights.data();
+				float* weightSum = weightSums.data();
+				float* varianceSum = varianceSums.data();
+
+				for (int ky = 0; ky < 5; ++ky) {
+					int qy = y + (ky - 2) * step;
+					if (qy < 0 || qy >= height) {
+						continue;
+					}
+
+					for (int kx = 0; kx < 5; ++kx) {
+						// The neighbors of the texels [begin, end) of the row are within the map
+						int offset = (kx - 2) * step;
+						int begin = std::max(0, -offset);
+						int end = std::min(width, width - offset);
+						if (begin >= end) {
+							continue;
+						}
+
+						int qRow = qy * width;
+						const float* qPx = positions[0].data() + qRow;
+						const float* qPy = positions[1].data() + qRow;
+						const float* qPz = positions[2].data() + qRow;
+						const float* qNx = normals[0].data() + qRow;
+						const float* qNy = normals[1].data() + qRow;
+						const float* qNz = normals[2].data() + qRow;
+						const int* qChart = charts.data() + qRow;
+						const float* qLum = luminance.data() + qRow;
+						const float* qVariance = variance.data() + qRow;
+						float kernel = kernelWeights[kx] * kernelWeights[ky];
+
+						#pragma omp simd
+						for (int x = begin; x < end; ++x) {
+							float planeDistance = std::abs(nx[x] * (qPx[x + offset] - px[x]) + ny[x] * (qPy[x + offset] - py[x]) + nz[x] * (qPz[x + offset] - pz[x]));
+							float luminanceDistance = std::abs(qLum[x + offset] - lum[x]) * scale[x];
+							float cosine = nx[x] * qNx[x + offset] + ny[x] * qNy[x + offset] + nz[x] * qNz[x + offset];
+							// Other charts are moved out of reach instead of masked, for the same reason as above
+							float chartDistance = (qChart[x + offset] == chart[x]) ? 0.0f : maxStopDistance;
+							float weight = kernel * getNormalWeight(cosine) * getStopWeight(planeDistance * planeScale + luminanceDistance + chartDistance);
+							w[x] = weight;
+							weightSum[x] += weight;
+							varianceSum[x] += weight * weight * qVariance[x + offset];
+						}
+
+						for (int c = 0; c < numChannels; ++c) {
+							const float* qValues = channels[c].data() + qRow;
+							float* sum = sums[c].data();
+							#pragma omp simd
+							for (int x = begin; x < end; ++x) {
+								sum[x] += w[x] * qValues[x + offset];
+							}
+						}
+					}
+				}
+
+				// Texels without a chart keep their values, every other texel has at least
+				// the weight of its own tap
+				for (int x = 0; x < width; ++x) {
+					if (chart[x] < 0 || !(weightSum[x] > 0.0f)) {
+						for (int c = 0; c < numChannels; ++c) {
+							filtered[c][row + x] = channels[c][row + x];
+						}
+						nextVariance[row + x] = variance[row + x];
+						continue;
+					}
+
+					float invWeightSum = 1.0f / weightSum[x];
+					for (int c = 0; c < numChannels; ++c) {
+						filtered[c][row + x] = sums[c][x] * invWeightSum;
+					}
+					nextVariance[row + x] = varianceSum[x] * invWeightSum * invWeightSum;
+				}
+			}
+		}
+
+		std::swap(channels, filtered);
+		std::swap(variance, nextVariance);
+		updateLuminance();
+	}
+
+	for (int m = 0; m < numMaps; ++m) {
+		for (int i = 0; i < numTexels; ++i) {
+			for (int c = 0; c < 4; ++c) {
+				(*maps[m])[i][c] = channels[m * 4 + c][i];
+			}
+		}
+	}
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+// The surface that a light map texel shows, which guides the denoiser. Texels of different
+// charts of the light map layout are never blended, and neither are texels without a chart (-1).
+struct DenoiserTexel {
+	glm::vec3 position;
+	glm::vec3 normal;
+	int chart;
+};
+
+// Edge-avoiding à-trous wavelet filter in light map texel space. Every iteration blends each
+// texel with its 5x5 neighbors at twice the spacing of the previous one, weighted by their
+// distance to the tangent plane of the texel, the similarity of the normals and how far their
+// luminance is from its own relative to the noise in the neighborhood. The luminance is taken
+// from the values with the given channel weights. The linked values, like the sun part of the
+// values, are filtered with the same weights so that they stay a part of them.
+void denoiseLightMap(int width, int height, const std::vector<DenoiserTexel>& texels, const glm::vec4& luminanceWeights,
+	std::vector<glm::vec4>& values, std::vector<glm::vec4>* linkedValues, int iterations = 5);
@@ -4,12 +4,29 @@
 #include <fstream>
 #include <cstdint>
 
+namespace {
+	const std::uint32_t sunLayerMagic = 0x4c4e5553; // "SUNL"
+	const std::uint32_t sunKeyframesMagic = 0x4b444f54; // "TODK"
+}
+
 void readLightMapFromFile(const std::string& path, std::vector<SharedImage>& irradianceMaps) {
 	std::vector<SharedImage> temp;
 	readLightMapFromFile(path, irradianceMaps, temp);
 }
 
 void readLightMapFromFile(const std::string& path, std::vector<SharedImage>& irradianceMaps, std::vector<SharedImage>& aoMaps) {
+	std::vector<SharedImage> temp;
+	readLightMapFromFile(path, irradianceMaps, aoMaps, temp);
+}
+
+void readLightMapFromFile(const std::string& path, std::vector<SharedImage>& irradianceMaps, std::vector<SharedImage>& aoMaps,
+						  std::vector<SharedImage>& sunIrradianceMaps) {
+	std::vector<SunKeyframe> temp;
+	readLightMapFromFile(path, irradianceMaps, aoMaps, sunIrradianceMaps, temp);
+}
+
+void readLightMapFromFile(const std::string& path, std::vector<SharedImage>& irradianceMaps, std::vector<SharedImage>& aoMaps,
+						  std::vector<SharedImage>& sunIrradianceMaps, std::vector<SunKeyframe>& sunKeyframes) {
 	std::ifstream inputFile(path, std::ios::binary | std::ios::in);
 
 	std::uint32_t numIrradianceMaps;
@@ -45,4 +62,46 @@ void readLightMapFromFile(const std::string& path, std::vector<SharedImage>& irr
 
 		aoMaps.push_back(map);
 	}
+
+	std::uint32_t magic = 0;
+	std::uint32_t numSunIrradianceMaps = 0;
+	inputFile.read(reinterpret_cast<char*>(&magic), sizeof(std::uint32_t));
+	inputFile.read(reinterpret_cast<char*>(&numSunIrradianceMaps), sizeof(std::uint32_t));
+	if (!inputFile || magic != sunLayerMagic) {
+		return;
+	}
+
+	sunIrradianceMaps.reserve(numSunIrradianceMaps);
+	for (std::uint32_t i = 0; i < numSunIrradianceMaps; ++i) {
+		std::uint32_t width;
+		inputFile.read(reinterpret_cast<char*>(&width), sizeof(std::uint32_t));
+
+		std::uint32_t height;
+		inputFile.read(reinterpret_cast<char*>(&height), sizeof(std::uint32_t));
+
+		SharedImage map = std::make_shared<Image>(width, height, GL_RGB16F);
+		inputFile.read(map->getDataPtr<char>(), width * height * sizeof(glm::u16vec3));
+
+		sunIrradianceMaps.push_back(map);
+	}
+
+	std::uint32_t numKeyframes = 0;
+	inputFile.read(reinterpret_cast<char*>(&magic), sizeof(std::uint32_t));
+	inputFile.read(reinterpret_cast<char*>(&numKeyframes), sizeof(std::uint32_t));
+	if (!inputFile || magic != sunKeyframesMagic) {
+		return;
+	}
+
+	std::vector<SunKeyframe> keyframes(numKeyframes);
+	for (auto& keyframe : keyframes) {
+		inputFile.read(reinterpret_cast<char*>(&keyframe.direction), sizeof(glm::vec3));
+		for (const auto& base : sunIrradianceMaps) {
+			SharedImage map = readSunKeyframeDelta(inputFile, *base);
+			if (!map) {
+				return;
+			}
+			keyframe.sunIrradianceMaps.push_back(map);
+		}
+	}
+	sunKeyframes = std::move(keyframes);
 }
\ No newline at end of file
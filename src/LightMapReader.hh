@@ -1,9 +1,16 @@
 #pragma once
 
 #include "Image.hh"
+#include "SunKeyframes.hh"
 
 #include <string>
 #include <vector>
 
 void readLightMapFromFile(const std::string& path, std::vector<SharedImage>& irradianceMaps);
-void readLightMapFromFile(const std::string& path, std::vector<SharedImage>& irradianceMaps, std::vector<SharedImage>& aoMaps);
\ No newline at end of file
+void readLightMapFromFile(const std::string& path, std::vector<SharedImage>& irradianceMaps, std::vector<SharedImage>& aoMaps);
+
+// The sun layers stay empty for files without them, their irradiance maps hold all of the light
+void readLightMapFromFile(const std::string& path, std::vector<SharedImage>& irradianceMaps, std::vector<SharedImage>& aoMaps,
+						  std::vector<SharedImage>& sunIrradianceMaps);
+void readLightMapFromFile(const std::string& path, std::vector<SharedImage>& irradianceMaps, std::vector<SharedImage>& aoMaps,
+						  std::vector<SharedImage>& sunIrradianceMaps, std::vector<SunKeyframe>& sunKeyframes);
\ No newline at end of file
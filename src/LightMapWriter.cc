@@ -1,14 +1,31 @@
 #include "LightMapWriter.hh"
 
+#include <glow/common/log.hh>
 #include <glm/glm.hpp>
+#include <algorithm>
 #include <fstream>
 #include <cstdint>
 
+namespace {
+	const std::uint32_t sunLayerMagic = 0x4c4e5553; // "SUNL"
+	const std::uint32_t sunKeyframesMagic = 0x4b444f54; // "TODK"
+}
+
 void writeLightMapToFile(const std::string& path, const std::vector<SharedImage>& irradianceMaps) {
 	writeLightMapToFile(path, irradianceMaps, std::vector<SharedImage>());
 }
 
 void writeLightMapToFile(const std::string& path, const std::vector<SharedImage>& irradianceMaps, const std::vector<SharedImage>& aoMaps) {
+	writeLightMapToFile(path, irradianceMaps, aoMaps, std::vector<SharedImage>());
+}
+
+void writeLightMapToFile(const std::string& path, const std::vector<SharedImage>& irradianceMaps, const std::vector<SharedImage>& aoMaps,
+						 const std::vector<SharedImage>& sunIrradianceMaps) {
+	writeLightMapToFile(path, irradianceMaps, aoMaps, sunIrradianceMaps, std::vector<SunKeyframe>());
+}
+
+void writeLightMapToFile(const std::string& path, const std::vector<SharedImage>& irradianceMaps, const std::vector<SharedImage>& aoMaps,
+						 const std::vector<SharedImage>& sunIrradianceMaps, const std::vector<SunKeyframe>& sunKeyframes) {
 	std::ofstream outputFile(path, std::ios::binary | std::ios::trunc | std::ios::out);
 
 	std::uint32_t numIrradianceMaps = static_cast<std::uint32_t>(irradianceMaps.size());
@@ -22,7 +39,7 @@ void writeLightMapToFile(const std::string& path, const std::vector<SharedImage>
 		std::uint32_t height = map->getHeight();
 		outputFile.write(reinterpret_cast<const char*>(&width), sizeof(std::uint32_t));
 		outputFile.write(reinterpret_cast<const char*>(&height), sizeof(std::uint32_t));
-		outputFile.write(map->getDataPtr<char>(), width * height * sizeof(glm::u16vec3));
+		outputFile.write(reinterpret_cast<const char*>(map->getRowMajorData().data()), width * height * sizeof(glm::u16vec3));
 	}
 
 	for (const auto& map : aoMaps) {
@@ -30,7 +47,36 @@ void writeLightMapToFile(const std::string& path, const std::vector<SharedImage>
 		std::uint32_t height = map->getHeight();
 		outputFile.write(reinterpret_cast<const char*>(&width), sizeof(std::uint32_t));
 		outputFile.write(reinterpret_cast<const char*>(&height), sizeof(std::uint32_t));
-		outputFile.write(map->getDataPtr<char>(), width * height * sizeof(glm::uint16));
+		outputFile.write(reinterpret_cast<const char*>(map->getRowMajorData().data()), width * height * sizeof(glm::uint16));
+	}
+
+	if (!sunIrradianceMaps.empty()) {
+		std::uint32_t numSunIrradianceMaps = static_cast<std::uint32_t>(sunIrradianceMaps.size());
+		outputFile.write(reinterpret_cast<const char*>(&sunLayerMagic), sizeof(std::uint32_t));
+		outputFile.write(reinterpret_cast<const char*>(&numSunIrradianceMaps), sizeof(std::uint32_t));
+
+		for (const auto& map : sunIrradianceMaps) {
+			std::uint32_t width = map->getWidth();
+			std::uint32_t height = map->getHeight();
+			outputFile.write(reinterpret_cast<const char*>(&width), sizeof(std::uint32_t));
+			outputFile.write(reinterpret_cast<const char*>(&height), sizeof(std::uint32_t));
+			outputFile.write(reinterpret_cast<const char*>(map->getRowMajorData().data()), width * height * sizeof(glm::u16vec3));
+		}
+	}
+
+	if (!sunIrradianceMaps.empty() && !sunKeyframes.empty()) {
+		std::uint32_t numKeyframes = static_cast<std::uint32_t>(sunKeyframes.size());
+		outputFile.write(reinterpret_cast<const char*>(&sunKeyframesMagic), sizeof(std::uint32_t));
+		outputFile.write(reinterpret_cast<const char*>(&numKeyframes), sizeof(std::uint32_t));
+
+		float maxError = 0.0f;
+		for (const auto& keyframe : sunKeyframes) {
+			outputFile.write(reinterpret_cast<const char*>(&keyframe.direction), sizeof(glm::vec3));
+			for (std::size_t i = 0; i < sunIrradianceMaps.size(); ++i) {
+				maxError = std::max(maxError, writeSunKeyframeDelta(outputFile, *keyframe.sunIrradianceMaps[i], *sunIrradianceMaps[i]));
+			}
+		}
+		glow::info() << "Stored " << numKeyframes << " time-of-day keyframes with a relative error of at most " << maxError;
 	}
 
 	outputFile.close();
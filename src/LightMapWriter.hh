@@ -1,9 +1,21 @@
 #pragma once
 
 #include "Image.hh"
+#include "SunKeyframes.hh"
 
 #include <string>
 #include <vector>
 
 void writeLightMapToFile(const std::string& path, const std::vector<SharedImage>& irradianceMaps);
-void writeLightMapToFile(const std::string& path, const std::vector<SharedImage>& irradianceMaps, const std::vector<SharedImage>& aoMaps);
\ No newline at end of file
+void writeLightMapToFile(const std::string& path, const std::vector<SharedImage>& irradianceMaps, const std::vector<SharedImage>& aoMaps);
+
+// With sun layers, the irradiance maps only hold the light that was not emitted by the sun
+// and the sun layers the irradiance of a sun with unit radiance. They are appended after
+// the other maps, so readers that do not know them still find the rest of the file.
+void writeLightMapToFile(const std::string& path, const std::vector<SharedImage>& irradianceMaps, const std::vector<SharedImage>& aoMaps,
+						 const std::vector<SharedImage>& sunIrradianceMaps);
+
+// The sun layers of a time-of-day bake are stored as deltas to the given sun layers, which
+// should be their getSunKeyframeBase()
+void writeLightMapToFile(const std::string& path, const std::vector<SharedImage>& irradianceMaps, const std::vector<SharedImage>& aoMaps,
+						 const std::vector<SharedImage>& sunIrradianceMaps, const std::vector<SunKeyframe>& sunKeyframes);
\ No newline at end of file
@@ -3,8 +3,13 @@
 #include "IlluminationBaker.hh"
 #include "Scene.hh"
 #include "LightMapWriter.hh"
+#include "BakeCheckpoint.hh"
 
 #include <glow/common/str_utils.hh>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <memory>
 #include <string>
 
 // Format:
@@ -15,9 +20,28 @@
 //   -ao <w> <h> <spp> : enable ambient occlusion baking with the given width, height and samples per pixel
 //   -irr <w> <h> <spp> : enable irradiance baking with the given width, height and samples per pixel
 //   -light <power> : sets the light power
+//   -bounces <n> : sets the maximum path depth
+//   -sampler <random|sobol|halton|rank1> : sets the sample sequence used for baking (default: sobol)
+//   -stream <0|1> : traces the irradiance samples in batches with Embree's stream API (default: 1)
+//   -gbuffer-cache <dir> : caches the rasterized light map texels of each primitive in an existing directory
+//   -adaptive <error> : takes samples in every texel until its relative error is below the target, between a quarter and four times the samples per pixel (default: 0, off)
+//   -progressive <spp> : bakes in passes of the given samples per texel and writes a checkpoint after every pass
+//   -checkpoint <path> : sets the checkpoint file of a progressive bake (default: <output-path>.checkpoint)
+//   -resume : continues a progressive bake from its checkpoint
+//   -time-budget <seconds> : ends a progressive bake with the samples so far before the next pass would exceed the time
+//   -shard <i>/<n> : bakes the i-th of n parts of the texels and writes their samples to <output-path> instead of the light maps
+//   -merge <shard-path>... : combines the samples of all shards of a bake with the same options into the light maps
+//   -sun-layer <0|1> : stores the irradiance of the sun in separate layers that follow the sun's color and power at runtime (default: 1)
+//   -radiosity <passes> : bakes the irradiance in passes of one bounce that reflect the irradiance maps of the previous pass, instead of tracing -bounces per path
+//   -guide <0|1> : learns where the light comes from in early passes and samples the bounces of later passes toward it, not with -shard, -merge, -resume or -time-budget (default: 0)
+//   -radiance-cache <depth> : ends paths after the given number of bounces at the irradiance that earlier passes found nearby, not with -shard, -merge, -resume or -time-budget (default: 0, off)
+//   -time-of-day <n> : bakes the sun layers for n sun directions from sunrise to sunset through the scene's sun, which the viewer blends between
+//   -denoise <iterations> : filters the light maps with an edge-avoiding filter that keeps to the surfaces and charts of the texels (default: 0, off)
 // Examples:
 //   baked-gi myscene.gltf prebaked.lm probes.pd
 //   baked-gi myscene.gltf -bake prebaked.lm -irr 256 256 2000 -light 10
+//   baked-gi myscene.gltf -bake shard0.bin -irr 256 256 2000 -shard 0/2
+//   baked-gi myscene.gltf -bake prebaked.lm -irr 256 256 2000 -merge shard0.bin shard1.bin
 int main(int argc, char* argv[]) {
 	std::string gltfPath = "models/presentation_video.glb";
 	std::string lmPath = "textures/presentation_video.lm";
@@ -27,6 +51,22 @@ int main(int argc, char* argv[]) {
 	int irrWidth = 0, irrHeight = 0, irrSpp = 0;
 	float lightStrength = 5.0f;
 	int maxBounces = 10;
+	SampleSequence sampleSequence = SampleSequence::Sobol;
+	bool useStreamTracing = true;
+	std::string gbufferCacheDirectory;
+	float targetRelativeError = 0.0f;
+	int samplesPerPass = 0;
+	std::string checkpointPath;
+	bool resume = false;
+	double timeBudget = 0.0;
+	int shardIndex = 0, shardCount = 0;
+	std::vector<std::string> shardPaths;
+	int radiosityPasses = 0;
+	bool useSunLayer = true;
+	int timeOfDayKeyframes = 0;
+	bool usePathGuiding = false;
+	int radianceCacheDepth = 0;
+	int denoiseIterations = 0;
 
 	if (argc >= 2) {
 		gltfPath = std::string(argv[1]);
@@ -84,6 +124,166 @@ int main(int argc, char* argv[]) {
 					maxBounces = std::atoi(argv[i + 1]);
 					i += 2;
 				}
+				else if (std::strcmp(argv[i], "-sampler") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -sampler <random|sobol|halton|rank1>";
+						return -1;
+					}
+
+					std::string name(argv[i + 1]);
+					if (name == "random") {
+						sampleSequence = SampleSequence::Random;
+					}
+					else if (name == "sobol") {
+						sampleSequence = SampleSequence::Sobol;
+					}
+					else if (name == "halton") {
+						sampleSequence = SampleSequence::Halton;
+					}
+					else if (name == "rank1") {
+						sampleSequence = SampleSequence::Rank1;
+					}
+					else {
+						glow::error() << "Unknown sampler " << name;
+						return -1;
+					}
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-stream") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -stream <0|1>";
+						return -1;
+					}
+
+					useStreamTracing = std::atoi(argv[i + 1]) != 0;
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-gbuffer-cache") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -gbuffer-cache <dir>";
+						return -1;
+					}
+
+					gbufferCacheDirectory = argv[i + 1];
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-adaptive") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -adaptive <error>";
+						return -1;
+					}
+
+					targetRelativeError = static_cast<float>(std::atof(argv[i + 1]));
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-progressive") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -progressive <spp>";
+						return -1;
+					}
+
+					samplesPerPass = std::atoi(argv[i + 1]);
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-checkpoint") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -checkpoint <path>";
+						return -1;
+					}
+
+					checkpointPath = argv[i + 1];
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-resume") == 0) {
+					resume = true;
+					i += 1;
+				}
+				else if (std::strcmp(argv[i], "-time-budget") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -time-budget <seconds>";
+						return -1;
+					}
+
+					timeBudget = std::atof(argv[i + 1]);
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-shard") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -shard <i>/<n>";
+						return -1;
+					}
+
+					if (std::sscanf(argv[i + 1], "%d/%d", &shardIndex, &shardCount) != 2
+							|| shardCount <= 0 || shardIndex < 0 || shardIndex >= shardCount) {
+						glow::error() << "Invalid shard " << argv[i + 1] << ", expected <i>/<n> with 0 <= i < n";
+						return -1;
+					}
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-sun-layer") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -sun-layer <0|1>";
+						return -1;
+					}
+
+					useSunLayer = std::atoi(argv[i + 1]) != 0;
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-radiosity") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -radiosity <passes>";
+						return -1;
+					}
+
+					radiosityPasses = std::atoi(argv[i + 1]);
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-guide") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -guide <0|1>";
+						return -1;
+					}
+
+					usePathGuiding = std::atoi(argv[i + 1]) != 0;
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-radiance-cache") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -radiance-cache <depth>";
+						return -1;
+					}
+
+					radianceCacheDepth = std::atoi(argv[i + 1]);
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-time-of-day") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -time-of-day <n>";
+						return -1;
+					}
+
+					timeOfDayKeyframes = std::atoi(argv[i + 1]);
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-denoise") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -denoise <iterations>";
+						return -1;
+					}
+
+					denoiseIterations = std::atoi(argv[i + 1]);
+					i += 2;
+				}
+				else if (std::strcmp(argv[i], "-merge") == 0) {
+					if (i + 1 >= argc) {
+						glow::error() << "No enough arguments: -merge <shard-path>...";
+						return -1;
+					}
+
+					for (i += 1; i < argc && argv[i][0] != '-'; ++i) {
+						shardPaths.push_back(argv[i]);
+					}
+				}
 				else {
 					glow::error() << "Unknown argument " << argv[i];
 				}
@@ -135,27 +335,228 @@ int main(int argc, char* argv[]) {
 		pathTracer.setBackgroundCubeMap(skybox);
 		pathTracer.setMaxPathDepth(maxBounces);
 
+		glm::vec3 sceneMin, sceneMax;
+		scene.getBoundingBox(sceneMin, sceneMax);
+		PathGuide pathGuide(sceneMin, sceneMax);
+		if (usePathGuiding) {
+			pathTracer.setPathGuide(&pathGuide);
+		}
+
+		// Cells of about 2x2 irradiance texels of a light map that spans the scene. Smaller
+		// cells are less biased but need more samples before paths can end in them.
+		glm::vec3 sceneExtent = sceneMax - sceneMin;
+		std::unique_ptr<RadianceCache> radianceCache;
+		if (radianceCacheDepth > 0) {
+			float cellsPerExtent = static_cast<float>(std::max(irrWidth / 2, 16));
+			radianceCache.reset(new RadianceCache(std::max(sceneExtent.x, std::max(sceneExtent.y, sceneExtent.z)) / cellsPerExtent));
+			pathTracer.setRadianceCache(radianceCache.get(), radianceCacheDepth);
+		}
+
 		IlluminationBaker illuminationBaker(pathTracer);
+		illuminationBaker.setSampleSequence(sampleSequence);
+		illuminationBaker.setUseStreamTracing(useStreamTracing);
+		illuminationBaker.setTexelGBufferCacheDirectory(gbufferCacheDirectory);
+		illuminationBaker.setTargetRelativeError(targetRelativeError);
+		illuminationBaker.setDenoiseIterations(denoiseIterations);
+		if (shardCount > 0) {
+			illuminationBaker.setShard(shardIndex, shardCount);
+		}
 
-		std::vector<SharedImage> irradianceMaps;
-		if (irrWidth > 0 && irrHeight > 0 && irrSpp > 0) {
-			for (std::size_t i = 0; i < scene.getPrimitives().size(); ++i) {
-				glow::info() << "Baking irradiance map " << i + 1 << " of " << scene.getPrimitives().size() << " for " << scene.getPrimitives()[i].name;
-				auto lightMapImage = illuminationBaker.bakeIrradiance(scene.getPrimitives()[i], irrWidth, irrHeight, irrSpp);
-				irradianceMaps.push_back(lightMapImage);
+		// All maps of a primitive are next to each other, so they can share the rasterization
+		std::vector<BakeJob> jobs;
+		for (const auto& primitive : scene.getPrimitives()) {
+			if (irrWidth > 0 && irrHeight > 0 && irrSpp > 0) {
+				jobs.push_back({ &primitive, BakeMapType::Irradiance, irrWidth, irrHeight, irrSpp });
+				if (useSunLayer) {
+					jobs.push_back({ &primitive, BakeMapType::SunIrradiance, irrWidth, irrHeight, irrSpp });
+				}
+			}
+
+			if (aoWidth > 0 && aoHeight > 0 && aoSpp > 0) {
+				jobs.push_back({ &primitive, BakeMapType::AmbientOcclusion, aoWidth, aoHeight, aoSpp, 0.15f });
 			}
 		}
 
+		if (radiosityPasses > 0 && (irrWidth <= 0 || irrHeight <= 0 || irrSpp <= 0)) {
+			glow::error() << "-radiosity needs an irradiance bake (-irr)";
+			return -1;
+		}
+
+		if (radiosityPasses > 0 && (!shardPaths.empty() || shardCount > 0 || samplesPerPass > 0 || resume || timeBudget > 0.0)) {
+			glow::error() << "-radiosity cannot be combined with sharded or progressive bakes";
+			return -1;
+		}
+
+		if (timeOfDayKeyframes > 0 && (irrWidth <= 0 || irrHeight <= 0 || irrSpp <= 0 || !useSunLayer)) {
+			glow::error() << "-time-of-day needs an irradiance bake (-irr) with sun layers";
+			return -1;
+		}
+
+		if (timeOfDayKeyframes > 0 && (radiosityPasses > 0 || !shardPaths.empty() || shardCount > 0 || samplesPerPass > 0 || resume || timeBudget > 0.0)) {
+			glow::error() << "-time-of-day cannot be combined with radiosity, sharded or progressive bakes";
+			return -1;
+		}
+
+		if ((usePathGuiding || radianceCacheDepth > 0) && (!shardPaths.empty() || shardCount > 0)) {
+			glow::error() << "-guide and -radiance-cache cannot be combined with sharded bakes";
+			return -1;
+		}
+
+		if ((usePathGuiding || radianceCacheDepth > 0) && (resume || timeBudget > 0.0)) {
+			glow::error() << "-guide and -radiance-cache cannot be combined with -resume or -time-budget";
+			return -1;
+		}
+
+		BakeSettings settings;
+		settings.sampleSequence = sampleSequence;
+		settings.maxPathDepth = maxBounces;
+		settings.sun = scene.getSun();
+		settings.targetRelativeError = targetRelativeError;
+		settings.samplesPerPass = samplesPerPass;
+		settings.useSunLayer = useSunLayer;
+		settings.usePathGuiding = usePathGuiding;
+		settings.radianceCacheDepth = radianceCacheDepth;
+
+		glow::info() << "Baking " << jobs.size() << " light maps for " << scene.getPrimitives().size() << " primitives";
+		std::vector<SharedImage> bakedMaps;
+		std::vector<SunKeyframe> sunKeyframes;
+		if (!shardPaths.empty()) {
+			std::vector<BakeAccumulation> accumulations;
+			if (!mergeBakeCheckpoints(shardPaths, jobs, settings, accumulations)) {
+				return -1;
+			}
+
+			glow::info() << "Merged " << shardPaths.size() << " shards";
+			bakedMaps = illuminationBaker.resolveScene(jobs, accumulations);
+		}
+		else if (shardCount > 0 || samplesPerPass > 0 || resume || timeBudget > 0.0) {
+			// A shard keeps its samples in the output file, which is also its checkpoint.
+			// Without passes it is baked in one, like a bake of the whole scene.
+			if (samplesPerPass <= 0) {
+				samplesPerPass = shardCount > 0 && !resume && timeBudget <= 0.0 ? std::numeric_limits<int>::max() : 16;
+			}
+
+			if (checkpointPath.empty()) {
+				checkpointPath = shardCount > 0 ? outputPath : outputPath + ".checkpoint";
+			}
+
+			int checkpointShardIndex = shardCount > 0 ? shardIndex : 0;
+			int checkpointShardCount = shardCount > 0 ? shardCount : 1;
+			std::vector<BakeAccumulation> accumulations;
+			if (resume) {
+				if (readBakeCheckpoint(checkpointPath, jobs, settings, accumulations, checkpointShardIndex, checkpointShardCount)) {
+					glow::info() << "Resuming the bake from " << checkpointPath;
+				}
+				else {
+					glow::warning() << "No checkpoint of this bake found at " << checkpointPath << ", starting from the beginning";
+				}
+			}
+
+			auto startTime = std::chrono::steady_clock::now();
+			auto passStartTime = startTime;
+			int pass = 0;
+			illuminationBaker.bakeSceneProgressive(jobs, samplesPerPass, accumulations, [&]() {
+				if (!writeBakeCheckpoint(checkpointPath, jobs, settings, accumulations, checkpointShardIndex, checkpointShardCount)) {
+					glow::warning() << "Could not write the checkpoint " << checkpointPath;
+				}
+
+				auto now = std::chrono::steady_clock::now();
+				double elapsed = std::chrono::duration<double>(now - startTime).count();
+				double passTime = std::chrono::duration<double>(now - passStartTime).count();
+				passStartTime = now;
+				glow::info() << "Finished pass " << ++pass << " after " << elapsed << " s";
+
+				// Stop if another pass of the same length would exceed the budget
+				return timeBudget <= 0.0 || elapsed + passTime <= timeBudget;
+			});
+
+			if (shardCount > 0) {
+				glow::info() << "Wrote the samples of shard " << shardIndex << "/" << shardCount << " to " << checkpointPath;
+				return 0;
+			}
+
+			bakedMaps = illuminationBaker.resolveScene(jobs, accumulations);
+		}
+		else if (radiosityPasses > 0) {
+			// The first pass starts with black maps, so it only holds the sky and one bounce
+			// of sun light. Every further pass adds a bounce.
+			pathTracer.setIrradianceCache(std::vector<SharedImage>(scene.getPrimitives().size()));
+			for (int pass = 0; pass < radiosityPasses; ++pass) {
+				bakedMaps = illuminationBaker.bakeScene(jobs);
+				glow::info() << "Finished radiosity pass " << pass + 1 << " of " << radiosityPasses;
+
+				std::vector<SharedImage> irradianceMaps;
+				std::vector<SharedImage> sunIrradianceMaps;
+				for (std::size_t i = 0; i < jobs.size(); ++i) {
+					if (jobs[i].type == BakeMapType::Irradiance) {
+						irradianceMaps.push_back(bakedMaps[i]);
+					}
+					else if (jobs[i].type == BakeMapType::SunIrradiance) {
+						sunIrradianceMaps.push_back(bakedMaps[i]);
+					}
+				}
+				pathTracer.setIrradianceCache(irradianceMaps, sunIrradianceMaps);
+			}
+		}
+		else if (timeOfDayKeyframes > 0) {
+			// The sky light, the ambient occlusion and the G-buffers do not depend on the sun,
+			// so they come from the bake of the first keyframe. The other keyframes only bake
+			// the sun layers, with paths that ignore the sky.
+			std::vector<glm::vec3> directions = getSunArcDirections(scene.getSun().direction, timeOfDayKeyframes);
+			std::vector<BakeJob> sunJobs;
+			for (const auto& job : jobs) {
+				if (job.type == BakeMapType::SunIrradiance) {
+					sunJobs.push_back(job);
+				}
+			}
+
+			for (int k = 0; k < timeOfDayKeyframes; ++k) {
+				scene.getSun().direction = directions[k];
+				SunKeyframe keyframe;
+				keyframe.direction = directions[k];
+				if (k == 0) {
+					bakedMaps = illuminationBaker.bakeScene(jobs);
+					for (std::size_t i = 0; i < jobs.size(); ++i) {
+						if (jobs[i].type == BakeMapType::SunIrradiance) {
+							keyframe.sunIrradianceMaps.push_back(bakedMaps[i]);
+						}
+					}
+					pathTracer.setBackgroundCubeMap(nullptr);
+				}
+				else {
+					keyframe.sunIrradianceMaps = illuminationBaker.bakeScene(sunJobs);
+				}
+
+				sunKeyframes.push_back(keyframe);
+				glow::info() << "Finished time of day keyframe " << k + 1 << " of " << timeOfDayKeyframes;
+			}
+		}
+		else {
+			bakedMaps = illuminationBaker.bakeScene(jobs);
+		}
+
+		std::vector<SharedImage> irradianceMaps;
 		std::vector<SharedImage> aoMaps;
-		if (aoWidth > 0 && aoHeight > 0 && aoSpp > 0) {
-			for (std::size_t i = 0; i < scene.getPrimitives().size(); ++i) {
-				glow::info() << "Baking ambient occlusion map " << i + 1 << " of " << scene.getPrimitives().size() << " for " << scene.getPrimitives()[i].name;
-				auto aoImage = illuminationBaker.bakeAmbientOcclusion(scene.getPrimitives()[i], aoWidth, aoHeight, aoSpp, 0.15f);
-				aoMaps.push_back(aoImage);
+		std::vector<SharedImage> sunIrradianceMaps;
+		for (std::size_t i = 0; i < jobs.size(); ++i) {
+			if (jobs[i].type == BakeMapType::Irradiance) {
+				irradianceMaps.push_back(bakedMaps[i]);
 			}
+			else if (jobs[i].type == BakeMapType::SunIrradiance) {
+				sunIrradianceMaps.push_back(bakedMaps[i]);
+			}
+			else {
+				aoMaps.push_back(bakedMaps[i]);
+			}
+		}
+
+		// The keyframes are stored as deltas to their mean, which stands in for the sun
+		// layers in viewers that do not know about the time of day
+		if (!sunKeyframes.empty()) {
+			sunIrradianceMaps = getSunKeyframeBase(sunKeyframes);
 		}
 
-		writeLightMapToFile(outputPath, irradianceMaps, aoMaps);
+		writeLightMapToFile(outputPath, irradianceMaps, aoMaps, sunIrradianceMaps, sunKeyframes);
 		return 0;
 	}
 	else {
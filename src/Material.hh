@@ -8,6 +8,9 @@ struct Material {
 	glow::SharedTexture2D roughnessMap;
 	glow::SharedTexture2D normalMap;
 	glow::SharedTexture2D lightMap;
+	glow::SharedTexture2D sunLightMap; // Irradiance of a sun with unit radiance, black if not baked separately
+	glow::SharedTexture2D nextSunLightMap; // Sun layer of the next time of day keyframe
+	float sunLightMapBlend = 0.0f; // Weight of nextSunLightMap
 	glow::SharedTexture2D aoMap;
 	float roughness = 0.5f;
 	float metallic = 0.0f;
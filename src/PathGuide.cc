@@ -0,0 +1,126 @@
+#include "PathGuide.hh"
+
+#include <glm/gtc/constants.hpp>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+	const int directionResolution = 8;
+	const int directionBins = directionResolution * directionResolution;
+
+	// Cells with fewer samples keep sampling the BSDF only
+	const std::uint32_t minCellSamples = 32;
+
+	// Weights are stored with 16 fractional bits. Single samples are clamped, so that a
+	// few fireflies cannot overflow the sums.
+	const float fixedPointScale = 65536.0f;
+	const float maxWeight = 1.0e6f;
+
+	int getDirectionBin(const glm::vec3& dir) {
+		float phi = std::atan2(dir.z, dir.x);
+		float x = (phi < 0.0f ? phi + 2.0f * glm::pi<float>() : phi) / (2.0f * glm::pi<float>());
+		float y = 0.5f - 0.5f * glm::clamp(dir.y, -1.0f, 1.0f);
+		int column = glm::clamp(static_cast<int>(x * directionResolution), 0, directionResolution - 1);
+		int row = glm::clamp(static_cast<int>(y * directionResolution), 0, directionResolution - 1);
+		return column + row * directionResolution;
+	}
+
+	// Picks the interval of a cdf and returns u remapped to [0, 1) within that interval
+	int sampleCdf(const float* cdf, int count, float u, float& remapped) {
+		int index = static_cast<int>(std::upper_bound(cdf, cdf + count + 1, u) - cdf) - 1;
+		index = glm::clamp(index, 0, count - 1);
+		float width = cdf[index + 1] - cdf[index];
+		remapped = (width > 0.0f) ? glm::clamp((u - cdf[index]) / width, 0.0f, 0.99999994f) : 0.5f;
+		return index;
+	}
+}
+
+PathGuide::PathGuide(const glm::vec3& boundsMin, const glm::vec3& boundsMax, int resolution) {
+	glm::vec3 extent = glm::max(boundsMax - boundsMin, glm::vec3(1.0e-4f));
+	float longestExtent = std::max(extent.x, std::max(extent.y, extent.z));
+
+	// Cubic cells, with a margin so that hits on the bounds fall into the grid
+	this->cellSize = longestExtent * 1.01f / resolution;
+	this->boundsMin = boundsMin - glm::vec3(longestExtent * 0.005f);
+	this->gridSize = glm::max(glm::ivec3(glm::ceil(extent * 1.01f / cellSize)), glm::ivec3(1));
+
+	std::size_t numCells = static_cast<std::size_t>(gridSize.x) * gridSize.y * gridSize.z;
+	binWeights.assign(numCells * directionBins, 0);
+	sampleCounts.assign(numCells, 0);
+	cdfs.assign(numCells * (directionBins + 1), 0.0f);
+	hasDistribution.assign(numCells, 0);
+}
+
+void PathGuide::record(const glm::vec3& position, const glm::vec3& dir, float weight) {
+	if (!(weight > 0.0f)) {
+		return;
+	}
+
+	int cell = getCellIndex(position);
+	std::uint64_t value = static_cast<std::uint64_t>(std::min(weight, maxWeight) * fixedPointScale);
+	std::uint64_t& binWeight = binWeights[cell * directionBins + getDirectionBin(dir)];
+	std::uint32_t& sampleCount = sampleCounts[cell];
+
+	#pragma omp atomic
+	binWeight += value;
+	#pragma omp atomic
+	sampleCount += 1;
+}
+
+void PathGuide::update() {
+	// The histograms keep the samples of all passes so far, every pass refines them
+	#pragma omp parallel for
+	for (int cell = 0; cell < static_cast<int>(sampleCounts.size()); ++cell) {
+		const std::uint64_t* weights = &binWeights[cell * directionBins];
+		float* cdf = &cdfs[cell * (directionBins + 1)];
+
+		double sum = 0.0;
+		cdf[0] = 0.0f;
+		for (int bin = 0; bin < directionBins; ++bin) {
+			sum += static_cast<double>(weights[bin]);
+			cdf[bin + 1] = static_cast<float>(sum);
+		}
+
+		hasDistribution[cell] = sampleCounts[cell] >= minCellSamples && sum > 0.0;
+		if (hasDistribution[cell]) {
+			for (int bin = 1; bin <= directionBins; ++bin) {
+				cdf[bin] /= cdf[directionBins];
+			}
+		}
+	}
+}
+
+void PathGuide::clear() {
+	std::fill(binWeights.begin(), binWeights.end(), 0);
+	std::fill(sampleCounts.begin(), sampleCounts.end(), 0);
+	std::fill(hasDistribution.begin(), hasDistribution.end(), 0);
+}
+
+int PathGuide::getCell(const glm::vec3& position) const {
+	int cell = getCellIndex(position);
+	return hasDistribution[cell] ? cell : -1;
+}
+
+glm::vec3 PathGuide::sampleDirection(int cell, const glm::vec2& u) const {
+	float columnOffset;
+	int bin = sampleCdf(&cdfs[cell * (directionBins + 1)], directionBins, u.x, columnOffset);
+	float x = (bin % directionResolution + columnOffset) / directionResolution;
+	float y = (bin / directionResolution + u.y) / directionResolution;
+
+	float cosTheta = 1.0f - 2.0f * y;
+	float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+	float phi = 2.0f * glm::pi<float>() * x;
+	return glm::vec3(sinTheta * std::cos(phi), cosTheta, sinTheta * std::sin(phi));
+}
+
+float PathGuide::pdfDirection(int cell, const glm::vec3& dir) const {
+	const float* cdf = &cdfs[cell * (directionBins + 1)];
+	int bin = getDirectionBin(dir);
+	float binSolidAngle = 4.0f * glm::pi<float>() / directionBins;
+	return (cdf[bin + 1] - cdf[bin]) / binSolidAngle;
+}
+
+int PathGuide::getCellIndex(const glm::vec3& position) const {
+	glm::ivec3 coords = glm::clamp(glm::ivec3(glm::floor((position - boundsMin) / cellSize)), glm::ivec3(0), gridSize - 1);
+	return coords.x + gridSize.x * (coords.y + gridSize.y * coords.z);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+// Online path guiding. The bounding box of the scene is split into a grid of cells and every
+// cell learns a histogram of its incident light over all directions, in bins of equal solid
+// angle (the cosine of the angle to +y and the azimuth split evenly). Paths add the light
+// they found with record(), update() turns the histograms into distributions between passes.
+//
+// The histograms are summed in fixed point with atomic adds, so they do not depend on the
+// order in which threads record their samples and a bake stays deterministic.
+class PathGuide {
+public:
+	PathGuide(const glm::vec3& boundsMin, const glm::vec3& boundsMax, int resolution = 16);
+
+	// The weight is the luminance of the incident radiance divided by the pdf of the direction
+	void record(const glm::vec3& position, const glm::vec3& dir, float weight);
+	void update();
+	void clear();
+
+	// Cell at the position, or -1 if it has not learned enough to be sampled yet
+	int getCell(const glm::vec3& position) const;
+	glm::vec3 sampleDirection(int cell, const glm::vec2& u) const;
+	float pdfDirection(int cell, const glm::vec3& dir) const; // With respect to solid angle
+
+private:
+	int getCellIndex(const glm::vec3& position) const;
+
+	glm::vec3 boundsMin;
+	float cellSize;
+	glm::ivec3 gridSize;
+	std::vector<std::uint64_t> binWeights; // Fixed point
+	std::vector<std::uint32_t> sampleCounts;
+	std::vector<float> cdfs; // One more entry than bins per cell
+	std::vector<unsigned char> hasDistribution;
+};
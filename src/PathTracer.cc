@@ -3,12 +3,13 @@
 
 #include <glow/objects/Texture2D.hh>
 #include <glow/data/SurfaceData.hh>
+#include <glm/gtc/packing.hpp>
 
 #include <xmmintrin.h>
 #include <limits>
 #include <cmath>
 #include <algorithm>
-#include <random>
+#include <unordered_map>
 #include <cassert>
 
 #if !defined(_MM_SET_DENORMALS_ZERO_MODE)
@@ -19,6 +20,90 @@
 #endif
 
 namespace {
+	float getTexelChannel(const Image& image, int x, int y, int channel, bool isSRGB) {
+		std::size_t index = image.getTexelIndex(x, y) * image.getChannels() + std::min(channel, image.getChannels() - 1);
+		if (image.getBitsPerPixel() == image.getChannels() * 32) {
+			float value = image.getDataPtr<float>()[index];
+			return isSRGB ? std::pow(value, 2.2f) : value;
+		}
+		if (image.getBitsPerPixel() == image.getChannels() * 16) {
+			float value = glm::unpackHalf1x16(image.getDataPtr<std::uint16_t>()[index]);
+			return isSRGB ? std::pow(value, 2.2f) : value;
+		}
+
+		unsigned char value = image.getDataPtr<unsigned char>()[index];
+		return isSRGB ? gammaToLinear(value) : value / 255.0f;
+	}
+
+	// Converts a color texture to linear float RGB once, so that lookups during
+	// the bake are only loads and lerps
+	SharedImage createLinearColorImage(const Image& source) {
+		auto image = std::make_shared<Image>(source.getWidth(), source.getHeight(), GL_RGB32F);
+		image->setWrapMode(source.getWrapS(), source.getWrapT());
+
+		float* dst = image->getDataPtr<float>();
+		for (int y = 0; y < source.getHeight(); ++y) {
+			for (int x = 0; x < source.getWidth(); ++x) {
+				for (int c = 0; c < 3; ++c) {
+					dst[image->getTexelIndex(x, y) * 3 + c] = getTexelChannel(source, x, y, c, true);
+				}
+			}
+		}
+		return image;
+	}
+
+	SharedImage createChannelImage(const Image& source, int channel) {
+		auto image = std::make_shared<Image>(source.getWidth(), source.getHeight(), GL_R32F);
+		image->setWrapMode(source.getWrapS(), source.getWrapT());
+
+		float* dst = image->getDataPtr<float>();
+		for (int y = 0; y < source.getHeight(); ++y) {
+			for (int x = 0; x < source.getWidth(); ++x) {
+				dst[image->getTexelIndex(x, y)] = getTexelChannel(source, x, y, channel, false);
+			}
+		}
+		return image;
+	}
+
+	// Probability of sampling the diffuse lobe, the specular lobe gets the rest
+	float getDiffuseProbability(const glm::vec3& diffuse, const glm::vec3& specular) {
+		float diffLum = glm::dot(diffuse, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+		float specLum = glm::dot(specular, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+		return diffLum / (diffLum + specLum);
+	}
+
+	float powerHeuristic(float pdf, float otherPdf) {
+		return (pdf * pdf) / (pdf * pdf + otherPdf * otherPdf);
+	}
+
+	// sampleBsdf() uses the first four dimensions of a bounce, the environment sample the next three
+	constexpr std::uint32_t environmentDimensionOffset = 4;
+
+	// Converts a mip level relative to a texel of a 1x1 texture into a level of the given image
+	float getTextureLod(const Image& image, float lod) {
+		return lod + 0.5f * std::log2(static_cast<float>(image.getWidth() * image.getHeight()));
+	}
+
+	// Bilinear lookup in a baked light map. Texel (x, y) of the bake covers the light map
+	// coordinates from (x, y) / (size - 1) on, with its sample in the middle.
+	glm::vec3 sampleLightMap(const Image& map, const glm::vec2& texCoord) {
+		int width = map.getWidth();
+		int height = map.getHeight();
+		glm::vec2 coord = glm::clamp(texCoord, 0.0f, 1.0f) * glm::vec2(width - 1, height - 1) - glm::vec2(0.5f);
+		coord = glm::clamp(coord, glm::vec2(0.0f), glm::vec2(width - 1, height - 1));
+
+		int x0 = static_cast<int>(coord.x);
+		int y0 = static_cast<int>(coord.y);
+		int x1 = std::min(x0 + 1, width - 1);
+		int y1 = std::min(y0 + 1, height - 1);
+		float dx = coord.x - x0;
+		float dy = coord.y - y0;
+
+		const glm::vec3* texels = map.getDataPtr<glm::vec3>();
+		return glm::mix(glm::mix(texels[x0 + y0 * width], texels[x1 + y0 * width], dx),
+			glm::mix(texels[x0 + y1 * width], texels[x1 + y1 * width], dx), dy);
+	}
+
 	struct alignas(16) Vec3A {
 		float x;
 		float y;
@@ -46,10 +131,6 @@ namespace {
 		}
 	};
 
-	std::random_device randDevice;
-	std::default_random_engine randEngine(randDevice());
-	std::uniform_real_distribution<float> uniformDist(0.0f, 1.0f);
-
 	void makeCoordinateSystem(const glm::vec3& normal, glm::vec3& xAxis, glm::vec3& yAxis) {
 		xAxis = glm::vec3(1.0f, 0.0f, 0.0f);
 		if (std::abs(1.0f - normal.x) < 1.0e-8f) {
@@ -63,9 +144,9 @@ namespace {
 		xAxis = glm::normalize(glm::cross(yAxis, normal));
 	}
 
-	glm::vec3 sampleCosineHemisphere(const glm::vec3& normal) {
-		float u1 = uniformDist(randEngine);
-		float u2 = uniformDist(randEngine);
+	glm::vec3 sampleCosineHemisphere(const glm::vec3& normal, const glm::vec2& u) {
+		float u1 = u.x;
+		float u2 = u.y;
 		
 		float r = std::sqrt(u1);
 		float phi = 2.0f * glm::pi<float>() * u2;
@@ -89,9 +170,9 @@ namespace {
 		return diffuse / glm::pi<float>();
 	}
 
-	glm::vec3 sampleGGX(const glm::vec3& direction, float roughness) {
-		float u1 = uniformDist(randEngine);
-		float u2 = uniformDist(randEngine);
+	glm::vec3 sampleGGX(const glm::vec3& direction, float roughness, const glm::vec2& u) {
+		float u1 = u.x;
+		float u2 = u.y;
 
 		float alpha = roughness * roughness;
 		float phi = 2.0f * glm::pi<float>() * u1;
@@ -147,6 +228,8 @@ namespace {
 	}
 }
 
+constexpr float PathTracer::diffuseConeSpread;
+
 PathTracer::PathTracer() {
 	_MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 	_MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
@@ -168,13 +251,19 @@ void PathTracer::buildScene(const std::vector<Primitive>& primitives) {
 		rtcReleaseScene(scene);
 	}
 	scene = rtcNewScene(device);
+	materials.clear();
+	textureImages.clear();
 	rtcSetSceneFlags(scene, RTCSceneFlags::RTC_SCENE_FLAG_ROBUST);
 	rtcSetSceneBuildQuality(scene, RTCBuildQuality::RTC_BUILD_QUALITY_HIGH);
+
+	// Textures are shared between primitives, so convert every source image only once
+	std::unordered_map<const Image*, SharedImage> linearColorImages;
+	std::unordered_map<const Image*, SharedImage> roughnessImages;
 	
 	for (const auto& primitive : primitives) {
 		RTCGeometry mesh = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
 		rtcSetGeometryBuildQuality(mesh, RTCBuildQuality::RTC_BUILD_QUALITY_HIGH);
-		rtcSetGeometryVertexAttributeCount(mesh, 3);
+		rtcSetGeometryVertexAttributeCount(mesh, 4);
 		
 		auto indexBuffer = static_cast<unsigned int*>(rtcSetNewGeometryBuffer(mesh, RTC_BUFFER_TYPE_INDEX,
 			0, RTC_FORMAT_UINT3, sizeof(unsigned int) * 3, primitive.indices.size() / 3));
@@ -231,69 +320,496 @@ void PathTracer::buildScene(const std::vector<Primitive>& primitives) {
 			}
 		}
 
+		if (!primitive.lightMapTexCoords.empty()) {
+			auto lightMapTexCoordBuffer = static_cast<Vec3A*>(rtcSetNewGeometryBuffer(mesh, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE,
+				3, RTC_FORMAT_FLOAT2, sizeof(Vec3A), primitive.lightMapTexCoords.size()));
+
+			for (std::size_t i = 0; i < primitive.lightMapTexCoords.size(); ++i) {
+				lightMapTexCoordBuffer[i].x = primitive.lightMapTexCoords[i].x;
+				lightMapTexCoordBuffer[i].y = primitive.lightMapTexCoords[i].y;
+			}
+		}
+
 		rtcCommitGeometry(mesh);
 		auto geomID = rtcAttachGeometry(scene, mesh);
 		rtcReleaseGeometry(mesh);
 
 		Material material;
-		material.albedoMap = primitive.albedoMap;
-		material.normalMap = primitive.normalMap;
-		material.roughnessMap = primitive.roughnessMap;
-		material.baseColor = primitive.baseColor;
+		material.geometry = rtcGetGeometry(scene, geomID);
+		material.albedoMap = nullptr;
+		material.normalMap = primitive.normalMap.get();
+		material.roughnessMap = nullptr;
+		if (primitive.albedoMap) {
+			auto& image = linearColorImages[primitive.albedoMap.get()];
+			if (!image) {
+				image = createLinearColorImage(*primitive.albedoMap);
+				image->generateMipmaps();
+				image->setLayout(ImageLayout::Tiled);
+				textureImages.push_back(image);
+			}
+			material.albedoMap = image.get();
+		}
+		if (primitive.roughnessMap) {
+			auto& image = roughnessImages[primitive.roughnessMap.get()];
+			if (!image) {
+				image = createChannelImage(*primitive.roughnessMap, 0);
+				image->generateMipmaps();
+				image->setLayout(ImageLayout::Tiled);
+				textureImages.push_back(image);
+			}
+			material.roughnessMap = image.get();
+		}
+		material.linearBaseColor = gammaToLinear(primitive.baseColor);
 		material.roughness = primitive.roughness;
 		material.metallic = primitive.metallic;
-		materials.insert({ geomID, material });
+		material.hasLightMapTexCoords = !primitive.lightMapTexCoords.empty();
+
+		if (!primitive.texCoords.empty()) {
+			material.textureLodBias.resize(primitive.indices.size() / 3);
+			for (std::size_t i = 0; i < material.textureLodBias.size(); ++i) {
+				unsigned int i0 = primitive.indices[i * 3 + 0];
+				unsigned int i1 = primitive.indices[i * 3 + 1];
+				unsigned int i2 = primitive.indices[i * 3 + 2];
+
+				glm::vec3 p0(vertexBuffer[i0].x, vertexBuffer[i0].y, vertexBuffer[i0].z);
+				glm::vec3 p1(vertexBuffer[i1].x, vertexBuffer[i1].y, vertexBuffer[i1].z);
+				glm::vec3 p2(vertexBuffer[i2].x, vertexBuffer[i2].y, vertexBuffer[i2].z);
+				glm::vec2 uv0 = primitive.texCoords[i0];
+				glm::vec2 uv1 = primitive.texCoords[i1];
+				glm::vec2 uv2 = primitive.texCoords[i2];
+
+				float worldArea = glm::length(glm::cross(p1 - p0, p2 - p0));
+				float uvArea = std::abs((uv1.x - uv0.x) * (uv2.y - uv0.y) - (uv2.x - uv0.x) * (uv1.y - uv0.y));
+				if (worldArea > 0.0f && uvArea > 0.0f) {
+					material.textureLodBias[i] = 0.5f * std::log2(uvArea / worldArea);
+				}
+				else {
+					material.textureLodBias[i] = 0.0f;
+				}
+			}
+		}
+
+		if (materials.size() <= geomID) {
+			materials.resize(geomID + 1);
+		}
+		materials[geomID] = material;
+
+		if (primitive.normalMap && std::find(textureImages.begin(), textureImages.end(), primitive.normalMap) == textureImages.end()) {
+			textureImages.push_back(primitive.normalMap);
+		}
 	}
 
 	rtcCommitScene(scene);
 }
 
-glm::vec3 PathTracer::trace(const glm::vec3& origin, const glm::vec3& dir, const glm::vec3& weight, int depth) const {
-	if (depth > maxPathDepth) {
-		return glm::vec3(0.0f);
+glm::vec3 PathTracer::trace(const glm::vec3& origin, const glm::vec3& dir, Sampler& sampler, float coneSpread) const {
+	RTCIntersectContext context;
+	rtcInitIntersectContext(&context);
+
+	PathState path = startPath(origin, dir, sampler, coneSpread);
+	while (path.active) {
+		extendPath(path, &context);
 	}
 
-	RTCRayHit rayhit = { Ray(origin, dir, 0.001f, std::numeric_limits<float>::infinity()), Hit() };
+	sampler = path.sampler;
+	return path.radiance;
+}
+
+glm::vec3 PathTracer::traceIrradiance(const glm::vec3& position, const glm::vec3& normal, Sampler& sampler) const {
+	IrradianceSample sample;
+	traceIrradiance(position, normal, sampler, sample);
+	return sample.irradiance;
+}
+
+void PathTracer::traceIrradiance(const glm::vec3& position, const glm::vec3& normal, Sampler& sampler, IrradianceSample& sample) const {
 	RTCIntersectContext context;
 	rtcInitIntersectContext(&context);
-	rtcIntersect1(scene, &context, &rayhit);
+
+	SurfaceHit receiver = makeReceiver(position, normal);
+	PathState path = startReceiverPath(receiver, sampler);
+
+	glm::vec3 environmentDir;
+	glm::vec3 environmentRadiance;
+	if (sampleEnvironment(path, receiver, true, environmentDir, environmentRadiance)) {
+		Ray environmentRay(position + normal * 0.001f, environmentDir, 0.0f, std::numeric_limits<float>::infinity());
+		rtcOccluded1(scene, &context, &environmentRay);
+		if (environmentRay.tfar >= 0.0f) {
+			path.radiance += clampContribution(environmentRadiance, path.depth);
+		}
+	}
+	addGuideVertex(path, position);
+
+	while (path.active) {
+		extendPath(path, &context);
+	}
+
+	sampler = path.sampler;
+	sample.irradiance = path.radiance;
+	sample.sunIrradiance = path.sunRadiance;
+	sample.firstHitDistance = path.firstHitDistance;
+
+	if (radianceCache) {
+		radianceCache->record(position, normal, sample.irradiance, sample.sunIrradiance);
+	}
+}
+
+PathTracer::PathState PathTracer::startPath(const glm::vec3& origin, const glm::vec3& dir,
+		const Sampler& sampler, float coneSpread) const {
+	return { origin, dir, glm::vec3(1.0f), glm::vec3(0.0f), glm::vec3(0.0f), sampler, 0.0f, coneSpread, 0.0f,
+		-std::numeric_limits<float>::infinity(), 0, true, 0, {} };
+}
+
+void PathTracer::extendPath(PathState& path) const {
+	RTCIntersectContext context;
+	rtcInitIntersectContext(&context);
+	extendPath(path, &context);
+}
+
+void PathTracer::extendPath(PathState& path, RTCIntersectContext* context) const {
+	RTCRayHit rayhit = { Ray(path.origin, path.dir, 0.001f, std::numeric_limits<float>::infinity()), Hit() };
+	rtcIntersect1(scene, context, &rayhit);
 
 	if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
-		if (backgroundCubeMap) {
-			return weight * backgroundCubeMap->sample(dir);
+		escapePath(path);
+		return;
+	}
+
+	if (path.depth == 0) {
+		path.firstHitDistance = rayhit.ray.tfar;
+	}
+
+	SurfaceHit hit;
+	evaluateSurfaceHit(rayhit, path, hit);
+
+	Ray occluderRay(hit.position + hit.normal * 0.001f, glm::normalize(-light->direction), 0.0f, std::numeric_limits<float>::infinity());
+	rtcOccluded1(scene, context, &occluderRay);
+
+	glm::vec3 environmentDir;
+	glm::vec3 environmentRadiance(0.0f);
+	path.sampler.startBounce(path.depth, environmentDimensionOffset);
+	if (!hit.hasCachedIrradiance && sampleEnvironment(path, hit, path.depth < maxPathDepth, environmentDir, environmentRadiance)) {
+		Ray environmentRay(hit.position + hit.normal * 0.001f, environmentDir, 0.0f, std::numeric_limits<float>::infinity());
+		rtcOccluded1(scene, context, &environmentRay);
+		if (environmentRay.tfar < 0.0f) {
+			environmentRadiance = glm::vec3(0.0f);
 		}
-		
-		return glm::vec3(0.0f);
 	}
 
-	glm::vec3 surfacePoint;
-	surfacePoint.x = rayhit.ray.org_x + rayhit.ray.dir_x * rayhit.ray.tfar;
-	surfacePoint.y = rayhit.ray.org_y + rayhit.ray.dir_y * rayhit.ray.tfar;
-	surfacePoint.z = rayhit.ray.org_z + rayhit.ray.dir_z * rayhit.ray.tfar;
+	continuePath(path, hit, occluderRay.tfar >= 0.0f, environmentRadiance);
+}
+
+void PathTracer::traceStream(const std::vector<glm::vec3>& origins, const std::vector<glm::vec3>& dirs,
+		std::vector<Sampler>& samplers, std::vector<glm::vec3>& radiance, float coneSpread) const {
+	assert(origins.size() == dirs.size() && origins.size() == samplers.size());
+
+	std::vector<PathState> paths;
+	paths.reserve(origins.size());
+	for (std::size_t i = 0; i < origins.size(); ++i) {
+		paths.push_back(startPath(origins[i], dirs[i], samplers[i], coneSpread));
+	}
+
+	RTCIntersectContext context;
+	rtcInitIntersectContext(&context);
+	tracePaths(paths, &context);
+
+	radiance.resize(paths.size());
+	for (std::size_t i = 0; i < paths.size(); ++i) {
+		radiance[i] = paths[i].radiance;
+		samplers[i] = paths[i].sampler;
+	}
+}
+
+void PathTracer::traceIrradianceStream(const std::vector<glm::vec3>& positions, const std::vector<glm::vec3>& normals,
+		std::vector<Sampler>& samplers, std::vector<glm::vec3>& radiance) const {
+	std::vector<IrradianceSample> samples;
+	traceIrradianceStream(positions, normals, samplers, samples);
+
+	radiance.resize(samples.size());
+	for (std::size_t i = 0; i < samples.size(); ++i) {
+		radiance[i] = samples[i].irradiance;
+	}
+}
+
+void PathTracer::traceIrradianceStream(const std::vector<glm::vec3>& positions, const std::vector<glm::vec3>& normals,
+		std::vector<Sampler>& samplers, std::vector<IrradianceSample>& samples) const {
+	assert(positions.size() == normals.size() && positions.size() == samplers.size());
+
+	// Sample the environment at every receiver before the paths are extended
+	std::vector<PathState> paths;
+	std::vector<Ray> environmentRays;
+	std::vector<glm::vec3> environmentRadiance(positions.size());
+	paths.reserve(positions.size());
+	environmentRays.reserve(positions.size());
+	for (std::size_t i = 0; i < positions.size(); ++i) {
+		SurfaceHit receiver = makeReceiver(positions[i], normals[i]);
+		paths.push_back(startReceiverPath(receiver, samplers[i]));
+
+		glm::vec3 environmentDir;
+		if (sampleEnvironment(paths[i], receiver, true, environmentDir, environmentRadiance[i])) {
+			environmentRays.emplace_back(positions[i] + normals[i] * 0.001f, environmentDir, 0.0f, std::numeric_limits<float>::infinity());
+		}
+		else {
+			environmentRays.emplace_back(glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 0.0f, -1.0f);
+		}
+	}
+
+	RTCIntersectContext context;
+	rtcInitIntersectContext(&context);
+	rtcOccluded1M(scene, &context, environmentRays.data(), static_cast<unsigned int>(environmentRays.size()), sizeof(Ray));
+
+	for (std::size_t i = 0; i < paths.size(); ++i) {
+		if (environmentRays[i].tfar >= 0.0f) {
+			paths[i].radiance += clampContribution(environmentRadiance[i], paths[i].depth);
+		}
+		addGuideVertex(paths[i], positions[i]);
+	}
+
+	tracePaths(paths, &context);
+
+	samples.resize(paths.size());
+	for (std::size_t i = 0; i < paths.size(); ++i) {
+		samples[i].irradiance = paths[i].radiance;
+		samples[i].sunIrradiance = paths[i].sunRadiance;
+		samples[i].firstHitDistance = paths[i].firstHitDistance;
+		samplers[i] = paths[i].sampler;
+
+		if (radianceCache) {
+			radianceCache->record(positions[i], normals[i], samples[i].irradiance, samples[i].sunIrradiance);
+		}
+	}
+}
+
+void PathTracer::tracePaths(std::vector<PathState>& paths, RTCIntersectContext* context) const {
+	std::vector<unsigned int> activePaths;
+	activePaths.reserve(paths.size());
+	for (std::size_t i = 0; i < paths.size(); ++i) {
+		if (paths[i].active) {
+			activePaths.push_back(static_cast<unsigned int>(i));
+		}
+	}
+
+	std::vector<RTCRayHit> rayhits;
+	std::vector<Ray> shadowRays;
+	std::vector<SurfaceHit> hits;
+	std::vector<glm::vec3> environmentRadiance;
+
+	while (!activePaths.empty()) {
+		auto numPaths = static_cast<unsigned int>(activePaths.size());
+
+		// Extend all paths by one segment
+		rayhits.resize(numPaths);
+		for (unsigned int i = 0; i < numPaths; ++i) {
+			const PathState& path = paths[activePaths[i]];
+			rayhits[i] = { Ray(path.origin, path.dir, 0.001f, std::numeric_limits<float>::infinity()), Hit() };
+		}
+		rtcIntersect1M(scene, context, rayhits.data(), numPaths, sizeof(RTCRayHit));
+
+		// Shade the hits and generate two shadow rays per hit, toward the sun and toward a
+		// sampled direction of the environment. Paths that left the scene or have no
+		// environment sample get shadow rays with a negative extent, which Embree ignores.
+		hits.resize(numPaths);
+		environmentRadiance.resize(numPaths);
+		shadowRays.clear();
+		shadowRays.reserve(numPaths * 2);
+		for (unsigned int i = 0; i < numPaths; ++i) {
+			PathState& path = paths[activePaths[i]];
+			if (rayhits[i].hit.geomID == RTC_INVALID_GEOMETRY_ID) {
+				escapePath(path);
+				shadowRays.emplace_back(glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 0.0f, -1.0f);
+				shadowRays.emplace_back(glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 0.0f, -1.0f);
+				continue;
+			}
+
+			if (path.depth == 0) {
+				path.firstHitDistance = rayhits[i].ray.tfar;
+			}
+
+			evaluateSurfaceHit(rayhits[i], path, hits[i]);
+			shadowRays.emplace_back(hits[i].position + hits[i].normal * 0.001f, glm::normalize(-light->direction),
+				0.0f, std::numeric_limits<float>::infinity());
+
+			glm::vec3 environmentDir;
+			path.sampler.startBounce(path.depth, environmentDimensionOffset);
+			if (!hits[i].hasCachedIrradiance && sampleEnvironment(path, hits[i], path.depth < maxPathDepth, environmentDir, environmentRadiance[i])) {
+				shadowRays.emplace_back(hits[i].position + hits[i].normal * 0.001f, environmentDir,
+					0.0f, std::numeric_limits<float>::infinity());
+			}
+			else {
+				shadowRays.emplace_back(glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 0.0f, -1.0f);
+			}
+		}
+		rtcOccluded1M(scene, context, shadowRays.data(), numPaths * 2, sizeof(Ray));
+
+		// Add the direct light and continue the surviving paths
+		unsigned int numActive = 0;
+		for (unsigned int i = 0; i < numPaths; ++i) {
+			PathState& path = paths[activePaths[i]];
+			if (path.active) {
+				bool isLit = shadowRays[i * 2].tfar >= 0.0f;
+				bool isEnvironmentVisible = shadowRays[i * 2 + 1].tfar >= 0.0f;
+				continuePath(path, hits[i], isLit, isEnvironmentVisible ? environmentRadiance[i] : glm::vec3(0.0f));
+			}
+
+			if (path.active) {
+				activePaths[numActive++] = activePaths[i];
+			}
+		}
+		activePaths.resize(numActive);
+	}
+}
+
+PathTracer::SurfaceHit PathTracer::makeReceiver(const glm::vec3& position, const glm::vec3& normal) const {
+	// White Lambertian surface, its outgoing radiance is irradiance / pi
+	SurfaceHit receiver;
+	receiver.position = position;
+	receiver.normal = normal;
+	receiver.V = normal;
+	receiver.diffuse = glm::vec3(1.0f);
+	receiver.specular = glm::vec3(0.0f);
+	receiver.roughness = 1.0f;
+	receiver.coneWidth = 0.0f;
+	receiver.guideCell = pathGuide ? pathGuide->getCell(position) : -1;
+	receiver.hasCachedIrradiance = false;
+	return receiver;
+}
+
+PathTracer::PathState PathTracer::startReceiverPath(const SurfaceHit& receiver, const Sampler& sampler) const {
+	PathState path = startPath(receiver.position, receiver.normal, sampler, diffuseConeSpread);
+
+	// f * cos / pdf is one for a cosine distributed direction
+	float guideProbability = getGuideProbability(receiver);
+	if (guideProbability == 0.0f) {
+		path.dir = sampleCosineHemisphere(receiver.normal, path.sampler.next2D());
+		path.bsdfPdf = pdfCosineHemisphere(receiver.normal, path.dir);
+		return path;
+	}
+
+	// The first dimension picks the strategy and is reused for its direction
+	glm::vec2 u = path.sampler.next2D();
+	if (u.x < guideProbability) {
+		path.dir = pathGuide->sampleDirection(receiver.guideCell, glm::vec2(u.x / guideProbability, u.y));
+	}
+	else {
+		u.x = (u.x - guideProbability) / (1.0f - guideProbability);
+		path.dir = sampleCosineHemisphere(receiver.normal, u);
+	}
+
+	float dotNL = glm::dot(receiver.normal, path.dir);
+	path.bsdfPdf = pdfScatter(receiver, path.dir);
+	if (dotNL <= 0.0f || path.bsdfPdf <= 0.0f) {
+		path.active = false;
+		return path;
+	}
+	path.throughput = glm::vec3(dotNL / (glm::pi<float>() * path.bsdfPdf));
+	return path;
+}
+
+void PathTracer::continuePath(PathState& path, const SurfaceHit& hit, bool isLit, const glm::vec3& environmentRadiance) const {
+	if (isLit) {
+		glm::vec3 sunRadiance = clampContribution(path.throughput * evaluateDirectLight(hit), path.depth);
+		path.radiance += sunRadiance;
+		path.sunRadiance += sunRadiance;
+	}
+
+	// The cached irradiance already holds the environment light and all bounces up to the
+	// previous pass, so it takes the place of the rest of the path
+	if (hit.hasCachedIrradiance) {
+		glm::vec3 reflectance = path.throughput * hit.diffuse;
+		path.radiance += clampContribution(reflectance * hit.cachedIrradiance, path.depth);
+		path.sunRadiance += clampContribution(reflectance * hit.cachedSunIrradiance, path.depth);
+		endPath(path);
+		return;
+	}
+
+	path.radiance += clampContribution(environmentRadiance, path.depth);
+
+	path.sampler.startBounce(path.depth);
+	if (path.depth < maxPathDepth && sampleBsdf(hit, path.sampler, path.throughput, path.dir, path.coneSpread)) {
+		path.origin = hit.position;
+		path.coneWidth = hit.coneWidth;
+		path.bsdfPdf = pdfScatter(hit, path.dir);
+		path.depth++;
+		addGuideVertex(path, hit.position);
+	}
+	else {
+		endPath(path);
+	}
+}
+
+void PathTracer::escapePath(PathState& path) const {
+	if (backgroundCubeMap) {
+		// Directions that the environment sampling could have produced as well are weighted
+		// against it, paths from a camera or with a fixed first direction are not
+		float weight = 1.0f;
+		if (path.bsdfPdf > 0.0f && backgroundCubeMap->hasSamplingDistribution()) {
+			weight = powerHeuristic(path.bsdfPdf, backgroundCubeMap->pdfDirection(path.dir));
+		}
+		path.radiance += clampContribution(path.throughput * backgroundCubeMap->sample(path.dir) * weight, path.depth);
+	}
+	endPath(path);
+}
+
+void PathTracer::endPath(PathState& path) const {
+	path.active = false;
+	if (!pathGuide) {
+		return;
+	}
+
+	// Everything the path gathered after leaving a vertex came in along its direction
+	for (int i = 0; i < path.numGuideVertices; ++i) {
+		const PathState::GuideVertex& vertex = path.guideVertices[i];
+		glm::vec3 incident = (path.radiance - vertex.radiance) / glm::max(vertex.throughput, glm::vec3(1.0e-6f));
+		float luminance = glm::dot(incident, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+		pathGuide->record(vertex.position, vertex.dir, luminance / vertex.pdf);
+	}
+}
+
+void PathTracer::addGuideVertex(PathState& path, const glm::vec3& position) const {
+	if (pathGuide && path.active && path.numGuideVertices < PathState::maxGuideVertices) {
+		path.guideVertices[path.numGuideVertices++] = { position, path.dir, path.throughput, path.radiance, path.bsdfPdf };
+	}
+}
+
+void PathTracer::evaluateSurfaceHit(const RTCRayHit& rayhit, const PathState& path, SurfaceHit& hit) const {
+	hit.position.x = rayhit.ray.org_x + rayhit.ray.dir_x * rayhit.ray.tfar;
+	hit.position.y = rayhit.ray.org_y + rayhit.ray.dir_y * rayhit.ray.tfar;
+	hit.position.z = rayhit.ray.org_z + rayhit.ray.dir_z * rayhit.ray.tfar;
+	hit.V = glm::normalize(glm::vec3(-rayhit.ray.dir_x, -rayhit.ray.dir_y, -rayhit.ray.dir_z));
+
+	const Material& material = materials[rayhit.hit.geomID];
 
 	alignas(16) glm::vec3 normal;
-	rtcInterpolate0(rtcGetGeometry(scene, rayhit.hit.geomID), rayhit.hit.primID,
+	rtcInterpolate0(material.geometry, rayhit.hit.primID,
 		rayhit.hit.u, rayhit.hit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 0, &normal[0], 3);
-	normal = glm::normalize(normal);
+	hit.normal = glm::normalize(normal);
 
-	if (glm::dot(normal, dir) > 0.0f) {
-		normal = -normal;
+	if (glm::dot(hit.normal, hit.V) < 0.0f) {
+		hit.normal = -hit.normal;
 	}
 
-	const Material& material = materials.at(rayhit.hit.geomID);
+	hit.coneWidth = path.coneWidth + path.coneSpread * rayhit.ray.tfar;
+
 	glm::vec3 albedo;
-	float roughness = material.roughness;
+	hit.roughness = material.roughness;
 	if (material.albedoMap) {
 		alignas(16) glm::vec2 texCoord;
-		rtcInterpolate0(rtcGetGeometry(scene, rayhit.hit.geomID), rayhit.hit.primID,
+		rtcInterpolate0(material.geometry, rayhit.hit.primID,
 			rayhit.hit.u, rayhit.hit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 2, &texCoord[0], 2);
 
-		albedo = gammaToLinear(glm::vec3(material.albedoMap->sample(texCoord))) * gammaToLinear(material.baseColor);
-		roughness *= material.roughnessMap->sample(texCoord).x;
+		// Ray cone footprint projected onto the surface, in mip levels of a 1x1 texture
+		float lod = std::log2(hit.coneWidth / std::max(glm::dot(hit.normal, hit.V), 0.001f));
+		if (!material.textureLodBias.empty()) {
+			lod += material.textureLodBias[rayhit.hit.primID];
+		}
+
+		albedo = glm::vec3(material.albedoMap->sample(texCoord, getTextureLod(*material.albedoMap, lod))) * material.linearBaseColor;
+		if (material.roughnessMap) {
+			hit.roughness *= material.roughnessMap->sample(texCoord, getTextureLod(*material.roughnessMap, lod)).x;
+		}
 
 		/*
 		alignas(16) glm::vec4 tangent;
-		rtcInterpolate0(rtcGetGeometry(scene, rayhit.hit.geomID), rayhit.hit.primID,
+		rtcInterpolate0(material.geometry, rayhit.hit.primID,
 			rayhit.hit.u, rayhit.hit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 1, &tangent[0], 4);
 
 		
@@ -309,73 +825,179 @@ glm::vec3 PathTracer::trace(const glm::vec3& origin, const glm::vec3& dir, const
 		*/
 	}
 	else {
-		albedo = gammaToLinear(material.baseColor);
+		albedo = material.linearBaseColor;
 	}
 
-	Ray occluderRay(surfacePoint + normal * 0.001f, glm::normalize(-light->direction), 0.0f, std::numeric_limits<float>::infinity());
-	RTCIntersectContext occluderContext;
-	rtcInitIntersectContext(&occluderContext);
-	rtcOccluded1(scene, &occluderContext, &occluderRay);
+	hit.diffuse = albedo * (1 - material.metallic);
+	hit.specular = glm::mix(glm::vec3(0.04f), albedo, material.metallic);
 
-	glm::vec3 diffuse = albedo * (1 - material.metallic);
-	glm::vec3 specular = glm::mix(glm::vec3(0.04f), albedo, material.metallic);
+	hit.guideCell = pathGuide ? pathGuide->getCell(hit.position) : -1;
 
-	glm::vec3 directIllumination(0.0f);
-	if (occluderRay.tfar >= 0.0f) {
-		glm::vec3 L = glm::normalize(-light->direction);
-		glm::vec3 V = glm::normalize(glm::vec3(-rayhit.ray.dir_x, -rayhit.ray.dir_y, -rayhit.ray.dir_z));
+	hit.cachedIrradiance = glm::vec3(0.0f);
+	hit.cachedSunIrradiance = glm::vec3(0.0f);
+	hit.hasCachedIrradiance = useIrradianceCache;
+	if (!useIrradianceCache && radianceCache && path.depth >= radianceCacheDepth) {
+		hit.hasCachedIrradiance = radianceCache->lookup(hit.position, hit.normal, hit.cachedIrradiance, hit.cachedSunIrradiance);
+	}
+	else if (useIrradianceCache && material.hasLightMapTexCoords) {
+		alignas(16) glm::vec2 lightMapTexCoord;
+		rtcInterpolate0(material.geometry, rayhit.hit.primID,
+			rayhit.hit.u, rayhit.hit.v, RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 3, &lightMapTexCoord[0], 2);
+
+		unsigned int geomID = rayhit.hit.geomID;
+		if (geomID < sunIrradianceCache.size() && sunIrradianceCache[geomID]) {
+			hit.cachedSunIrradiance = sampleLightMap(*sunIrradianceCache[geomID], lightMapTexCoord) * getSunRadiance();
+		}
+		hit.cachedIrradiance = hit.cachedSunIrradiance;
+		if (geomID < irradianceCache.size() && irradianceCache[geomID]) {
+			hit.cachedIrradiance += sampleLightMap(*irradianceCache[geomID], lightMapTexCoord);
+		}
+	}
+}
 
-		glm::vec3 shadingDiffuse = brdfLambert(diffuse);
-		glm::vec3 shadingSpecular = brdfCookTorrenceGGX(normal, V, L, std::max(0.01f, roughness), specular);
-		glm::vec3 shading = shadingDiffuse + shadingSpecular;
+glm::vec3 PathTracer::evaluateDirectLight(const SurfaceHit& hit) const {
+	glm::vec3 L = glm::normalize(-light->direction);
+	return evaluateBsdf(hit, L) * std::max(glm::dot(hit.normal, L), 0.0f) * gammaToLinear(light->color) * light->power;
+}
 
-		directIllumination = weight * shading * std::max(glm::dot(normal, L), 0.0f) * gammaToLinear(light->color) * light->power;
+glm::vec3 PathTracer::evaluateBsdf(const SurfaceHit& hit, const glm::vec3& wi) const {
+	glm::vec3 shading = brdfLambert(hit.diffuse);
+	if (hit.specular != glm::vec3(0.0f)) {
+		shading += brdfCookTorrenceGGX(hit.normal, hit.V, wi, std::max(0.01f, hit.roughness), hit.specular);
 	}
+	return shading;
+}
 
-	glm::vec3 indirectIllumination(0.0f);
+float PathTracer::pdfBsdf(const SurfaceHit& hit, const glm::vec3& wi) const {
+	float Pd = getDiffuseProbability(hit.diffuse, hit.specular);
+	float pdf = Pd * std::max(pdfCosineHemisphere(hit.normal, wi), 0.0f);
+	if (Pd < 1.0f) {
+		glm::vec3 R = glm::normalize(glm::reflect(-hit.V, hit.normal));
+		pdf += (1.0f - Pd) * pdfGGX(R, wi, glm::max(0.01f, hit.roughness));
+	}
+	return pdf;
+}
+
+float PathTracer::getGuideProbability(const SurfaceHit& hit) const {
+	// The guide learns the incident light, which is what the diffuse lobe needs
+	if (!pathGuide || hit.guideCell < 0) {
+		return 0.0f;
+	}
+	return 0.5f * getDiffuseProbability(hit.diffuse, hit.specular);
+}
+
+float PathTracer::pdfScatter(const SurfaceHit& hit, const glm::vec3& wi) const {
+	float guideProbability = getGuideProbability(hit);
+	float pdf = pdfBsdf(hit, wi);
+	if (guideProbability > 0.0f) {
+		pdf = guideProbability * pathGuide->pdfDirection(hit.guideCell, wi) + (1.0f - guideProbability) * pdf;
+	}
+	return pdf;
+}
+
+bool PathTracer::sampleEnvironment(PathState& path, const SurfaceHit& hit, bool isContinued, glm::vec3& wi, glm::vec3& radiance) const {
+	if (!backgroundCubeMap || !backgroundCubeMap->hasSamplingDistribution()) {
+		return false;
+	}
+
+	glm::vec2 u = path.sampler.next2D();
+	float uFace = path.sampler.next1D();
+	float pdf;
+	wi = backgroundCubeMap->sampleDirection(u, uFace, pdf);
+
+	float dotNL = glm::dot(hit.normal, wi);
+	if (dotNL <= 0.0f || pdf <= 0.0f) {
+		return false;
+	}
+
+	// Weighted against the BSDF sample that continues the path. The receivers always trace
+	// one, the last vertex of a path has none and keeps the whole contribution.
+	float weight = 1.0f;
+	if (isContinued) {
+		weight = powerHeuristic(pdf, pdfScatter(hit, wi));
+	}
+	radiance = path.throughput * evaluateBsdf(hit, wi) * dotNL * backgroundCubeMap->sample(wi) * (weight / pdf);
+	return true;
+}
+
+bool PathTracer::sampleBsdf(const SurfaceHit& hit, Sampler& sampler, glm::vec3& weight, glm::vec3& wi, float& coneSpread) const {
 	float rho = std::max(weight.x, std::max(weight.y, weight.z));
-	if (uniformDist(randEngine) <= rho) {
-		float diffLum = glm::dot(diffuse, glm::vec3(0.2126f, 0.7152f, 0.0722f));
-		float specLum = glm::dot(specular, glm::vec3(0.2126f, 0.7152f, 0.0722f));
-		float Pd = diffLum / (diffLum + specLum);
-		float Ps = specLum / (diffLum + specLum);
+	if (sampler.next1D() > rho) {
+		return false; // Absorb
+	}
 
-		if (uniformDist(randEngine) <= Pd) {
-			glm::vec3 brdf = brdfLambert(diffuse);
-			glm::vec3 wi = sampleCosineHemisphere(normal);
-			float pdf = pdfCosineHemisphere(normal, wi);
+	float Pd = getDiffuseProbability(hit.diffuse, hit.specular);
+	float Ps = 1.0f - Pd;
 
-			float dotNL = glm::dot(normal, wi);
-			assert(dotNL >= 0.0f);
+	float guideProbability = getGuideProbability(hit);
+	if (guideProbability > 0.0f) {
+		return sampleGuided(hit, sampler, guideProbability, rho, weight, wi, coneSpread);
+	}
 
-			glm::vec3 newWeight = weight * dotNL * brdf / (pdf * rho * Pd);
-			indirectIllumination = newWeight * trace(surfacePoint, wi, newWeight, depth + 1);
-		}
-		else {
-			glm::vec3 V = glm::normalize(glm::vec3(-rayhit.ray.dir_x, -rayhit.ray.dir_y, -rayhit.ray.dir_z));
-			glm::vec3 R = glm::normalize(glm::reflect(-V, normal));
-			glm::vec3 wi = sampleGGX(R, glm::max(0.01f, roughness));
-			float pdf = pdfGGX(R, wi, glm::max(0.01f, roughness));
+	if (sampler.next1D() <= Pd) {
+		glm::vec3 brdf = brdfLambert(hit.diffuse);
+		wi = sampleCosineHemisphere(hit.normal, sampler.next2D());
+		float pdf = pdfCosineHemisphere(hit.normal, wi);
 
-			glm::vec3 brdf = brdfCookTorrenceGGX(normal, V, wi, glm::max(0.01f, roughness), specular);
+		float dotNL = glm::dot(hit.normal, wi);
+		assert(dotNL >= 0.0f);
 
-			float dotNL = glm::dot(normal, wi);
-			assert(dotNL >= 0.0f);
+		weight *= dotNL * brdf / (pdf * rho * Pd);
+		coneSpread += diffuseConeSpread;
+	}
+	else {
+		glm::vec3 R = glm::normalize(glm::reflect(-hit.V, hit.normal));
+		wi = sampleGGX(R, glm::max(0.01f, hit.roughness), sampler.next2D());
+		float pdf = pdfGGX(R, wi, glm::max(0.01f, hit.roughness));
 
-			glm::vec3 newWeight = weight * dotNL * brdf / (pdf * rho * Ps);
-			indirectIllumination = newWeight * trace(surfacePoint, wi, newWeight, depth + 1);
-		}
+		glm::vec3 brdf = brdfCookTorrenceGGX(hit.normal, hit.V, wi, glm::max(0.01f, hit.roughness), hit.specular);
+
+		float dotNL = glm::dot(hit.normal, wi);
+		assert(dotNL >= 0.0f);
+
+		weight *= dotNL * brdf / (pdf * rho * Ps);
+		coneSpread += glm::max(0.01f, hit.roughness) * glm::max(0.01f, hit.roughness); // GGX alpha as lobe width
+	}
+
+	return true;
+}
+
+bool PathTracer::sampleGuided(const SurfaceHit& hit, Sampler& sampler, float guideProbability, float rho,
+		glm::vec3& weight, glm::vec3& wi, float& coneSpread) const {
+	// The lobe decision also picks between the guide and the BSDF, and the weight divides by
+	// the pdf of the whole mixture
+	float uLobe = sampler.next1D();
+	glm::vec2 u = sampler.next2D();
+	float roughness = glm::max(0.01f, hit.roughness);
+	if (uLobe < guideProbability) {
+		wi = pathGuide->sampleDirection(hit.guideCell, u);
+		coneSpread += diffuseConeSpread;
+	}
+	else if ((uLobe - guideProbability) / (1.0f - guideProbability) <= getDiffuseProbability(hit.diffuse, hit.specular)) {
+		wi = sampleCosineHemisphere(hit.normal, u);
+		coneSpread += diffuseConeSpread;
 	}
 	else {
-		// Absorb
+		glm::vec3 R = glm::normalize(glm::reflect(-hit.V, hit.normal));
+		wi = sampleGGX(R, roughness, u);
+		coneSpread += roughness * roughness;
 	}
 
-	glm::vec3 illumination = directIllumination + indirectIllumination;
-	if (depth >= clampDepth) {
-		illumination = glm::clamp(illumination, 0.0f, clampRadiance);
+	float dotNL = glm::dot(hit.normal, wi);
+	float pdf = pdfScatter(hit, wi);
+	if (dotNL <= 0.0f || pdf <= 0.0f) {
+		return false;
 	}
 
-	return illumination;
+	weight *= evaluateBsdf(hit, wi) * dotNL / (pdf * rho);
+	return true;
+}
+
+glm::vec3 PathTracer::clampContribution(const glm::vec3& radiance, int depth) const {
+	if (depth >= clampDepth) {
+		return glm::clamp(radiance, 0.0f, clampRadiance);
+	}
+	return radiance;
 }
 
 float PathTracer::testOcclusionDist(const glm::vec3& origin, const glm::vec3& dir) const {
@@ -391,6 +1013,111 @@ float PathTracer::testOcclusionDist(const glm::vec3& origin, const glm::vec3& di
 	return -std::numeric_limits<float>::infinity();
 }
 
+bool PathTracer::testOcclusion(const glm::vec3& origin, const glm::vec3& dir, float maxDistance) const {
+	Ray ray(origin, dir, 0.001f, maxDistance);
+	RTCIntersectContext context;
+	rtcInitIntersectContext(&context);
+	rtcOccluded1(scene, &context, &ray);
+	return ray.tfar < 0.0f;
+}
+
+void PathTracer::testOcclusionStream(const std::vector<glm::vec3>& origins, const std::vector<glm::vec3>& dirs,
+		float maxDistance, std::vector<unsigned char>& occluded) const {
+	assert(origins.size() == dirs.size());
+
+	std::vector<Ray> rays;
+	rays.reserve(origins.size());
+	for (std::size_t i = 0; i < origins.size(); ++i) {
+		rays.emplace_back(origins[i], dirs[i], 0.001f, maxDistance);
+	}
+
+	RTCIntersectContext context;
+	rtcInitIntersectContext(&context);
+	rtcOccluded1M(scene, &context, rays.data(), static_cast<unsigned int>(rays.size()), sizeof(Ray));
+
+	occluded.resize(rays.size());
+	for (std::size_t i = 0; i < rays.size(); ++i) {
+		occluded[i] = rays[i].tfar < 0.0f;
+	}
+}
+
+void PathTracer::testOcclusionBinnedStream(const std::vector<glm::vec3>& origins, const std::vector<glm::vec3>& dirs,
+		float maxDistance, int numBins, std::vector<int>& bins) const {
+	assert(origins.size() == dirs.size() && numBins > 0);
+
+	// All rays are tested against the whole distance first. For the occluded ones the
+	// interval that holds the nearest occluder is found by bisection, testing the near
+	// half of the remaining intervals with one any-hit query per step.
+	std::vector<unsigned char> occluded;
+	testOcclusionStream(origins, dirs, maxDistance, occluded);
+
+	std::vector<int> lowerBins;
+	std::vector<int> upperBins;
+	std::vector<unsigned int> searching;
+	std::vector<unsigned int> unoccluded;
+	bins.assign(origins.size(), numBins);
+	for (std::size_t i = 0; i < origins.size(); ++i) {
+		if (occluded[i]) {
+			searching.push_back(static_cast<unsigned int>(i));
+		}
+		else {
+			unoccluded.push_back(static_cast<unsigned int>(i));
+		}
+	}
+	lowerBins.assign(searching.size(), 0);
+	upperBins.assign(searching.size(), numBins);
+
+	RTCIntersectContext context;
+	rtcInitIntersectContext(&context);
+
+	// The remaining rays either hit something beyond maxDistance or leave the scene
+	std::vector<Ray> rays;
+	for (unsigned int i : unoccluded) {
+		rays.emplace_back(origins[i], dirs[i], maxDistance, std::numeric_limits<float>::infinity());
+	}
+	rtcOccluded1M(scene, &context, rays.data(), static_cast<unsigned int>(rays.size()), sizeof(Ray));
+	for (std::size_t i = 0; i < unoccluded.size(); ++i) {
+		if (rays[i].tfar >= 0.0f) {
+			bins[unoccluded[i]] = numBins + 1;
+		}
+	}
+
+	float binSize = maxDistance / numBins;
+	while (!searching.empty()) {
+		rays.clear();
+		for (std::size_t i = 0; i < searching.size(); ++i) {
+			int middle = (lowerBins[i] + upperBins[i]) / 2;
+			rays.emplace_back(origins[searching[i]], dirs[searching[i]],
+				std::max(lowerBins[i] * binSize, 0.001f), middle * binSize);
+		}
+		rtcOccluded1M(scene, &context, rays.data(), static_cast<unsigned int>(rays.size()), sizeof(Ray));
+
+		std::size_t numSearching = 0;
+		for (std::size_t i = 0; i < searching.size(); ++i) {
+			int middle = (lowerBins[i] + upperBins[i]) / 2;
+			if (rays[i].tfar < 0.0f) {
+				upperBins[i] = middle;
+			}
+			else {
+				lowerBins[i] = middle;
+			}
+
+			if (upperBins[i] - lowerBins[i] == 1) {
+				bins[searching[i]] = lowerBins[i];
+			}
+			else {
+				searching[numSearching] = searching[i];
+				lowerBins[numSearching] = lowerBins[i];
+				upperBins[numSearching] = upperBins[i];
+				numSearching++;
+			}
+		}
+		searching.resize(numSearching);
+		lowerBins.resize(numSearching);
+		upperBins.resize(numSearching);
+	}
+}
+
 float PathTracer::testIntersection(const glm::vec3& origin, const glm::vec3& dir, glm::vec3& normal) const {
     RTCRayHit rayhit = { Ray(origin, dir, 0.001f, std::numeric_limits<float>::infinity()), Hit() };
 	RTCIntersectContext context;
@@ -412,6 +1139,10 @@ void PathTracer::setLight(const DirectionalLight& light) {
 	this->light = &light;
 }
 
+glm::vec3 PathTracer::getSunRadiance() const {
+	return gammaToLinear(light->color) * light->power;
+}
+
 void PathTracer::setBackgroundCubeMap(const SharedCubeMap& cubemap) {
 	this->backgroundCubeMap = cubemap;
 }
@@ -424,6 +1155,46 @@ void PathTracer::setClampDepth(unsigned int depth) {
 	this->clampDepth = static_cast<int>(depth);
 }
 
+void PathTracer::setIrradianceCache(const std::vector<SharedImage>& maps, const std::vector<SharedImage>& sunMaps) {
+	// The baked maps hold half floats, which are converted once so that lookups are plain loads
+	auto convertMaps = [](const std::vector<SharedImage>& maps, std::vector<SharedImage>& cache) {
+		cache.clear();
+		for (const SharedImage& map : maps) {
+			SharedImage cachedMap;
+			if (map) {
+				cachedMap = std::make_shared<Image>(map->getWidth(), map->getHeight(), GL_RGB32F);
+				const glm::u16vec3* src = map->getDataPtr<glm::u16vec3>();
+				glm::vec3* dst = cachedMap->getDataPtr<glm::vec3>();
+				for (int i = 0; i < map->getWidth() * map->getHeight(); ++i) {
+					dst[i] = glm::unpackHalf(src[i]);
+				}
+			}
+			cache.push_back(cachedMap);
+		}
+	};
+
+	convertMaps(maps, irradianceCache);
+	convertMaps(sunMaps, sunIrradianceCache);
+	useIrradianceCache = true;
+}
+
+void PathTracer::setPathGuide(PathGuide* guide) {
+	pathGuide = guide;
+}
+
+PathGuide* PathTracer::getPathGuide() const {
+	return pathGuide;
+}
+
+void PathTracer::setRadianceCache(RadianceCache* cache, int depth) {
+	radianceCache = cache;
+	radianceCacheDepth = depth;
+}
+
+RadianceCache* PathTracer::getRadianceCache() const {
+	return radianceCache;
+}
+
 void PathTracer::setClampRadiance(float radiance) {
 	this->clampRadiance = radiance;
 }
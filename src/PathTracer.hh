@@ -3,29 +3,126 @@
 #include "Primitive.hh"
 #include "DirectionalLight.hh"
 #include "CubeMap.hh"
+#include "PathGuide.hh"
+#include "RadianceCache.hh"
+#include "Sampler.hh"
 
 #include <embree3/rtcore.h>
 #include <glow/fwd.hh>
 #include <glow-extras/camera/GenericCamera.hh>
 #include <glm/glm.hpp>
 #include <vector>
-#include <unordered_map>
 
 class PathTracer {
 public:
+	// Explicit state of a path. A path is advanced one bounce at a time with extendPath(),
+	// so paths can be traced in batches or handed between threads.
+	//
+	// Every path also carries a ray cone (width at the origin and spread angle) that is
+	// widened at each bounce and selects the mip level of texture lookups.
+	struct PathState {
+		// A surface vertex that the path left in dir, with the throughput after the bounce
+		// and the radiance before it. The path guide learns from them once the path ends.
+		struct GuideVertex {
+			glm::vec3 position;
+			glm::vec3 dir;
+			glm::vec3 throughput;
+			glm::vec3 radiance;
+			float pdf;
+		};
+		static constexpr int maxGuideVertices = 4;
+
+		glm::vec3 origin;
+		glm::vec3 dir;
+		glm::vec3 throughput;
+		glm::vec3 radiance;
+		glm::vec3 sunRadiance; // Part of radiance that was emitted by the sun
+		Sampler sampler;
+		float coneWidth;
+		float coneSpread;
+		float bsdfPdf; // Solid angle pdf of dir for MIS with the environment, zero if not sampled from a BSDF
+		float firstHitDistance; // Length of the first segment, negative infinity if it left the scene
+		int depth;
+		bool active;
+		int numGuideVertices;
+		GuideVertex guideVertices[maxGuideVertices];
+	};
+
+	// Cone spread angle (in radians) that is added by a diffuse bounce. Bake rays start
+	// with this spread as they are cosine distributed as well.
+	static constexpr float diffuseConeSpread = 0.5f;
+
 	PathTracer();
 	virtual ~PathTracer();
 	
 	void buildScene(const std::vector<Primitive>& primitives);
-	glm::vec3 trace(const glm::vec3& origin, const glm::vec3& dir, const glm::vec3& weight = glm::vec3(1.0f), int depth = 0) const;
+	glm::vec3 trace(const glm::vec3& origin, const glm::vec3& dir, Sampler& sampler, float coneSpread = 0.0f) const;
+
+	// An irradiance path split by light source, so that the sun can be rescaled after the bake
+	struct IrradianceSample {
+		glm::vec3 irradiance;
+		glm::vec3 sunIrradiance; // Part of irradiance that was emitted by the sun
+		float firstHitDistance;
+	};
+
+	// Irradiance / pi at a receiver with the given normal. The first direction is cosine
+	// distributed and the environment is importance sampled at the receiver as well.
+	glm::vec3 traceIrradiance(const glm::vec3& position, const glm::vec3& normal, Sampler& sampler) const;
+	void traceIrradiance(const glm::vec3& position, const glm::vec3& normal, Sampler& sampler, IrradianceSample& sample) const;
+
+	PathState startPath(const glm::vec3& origin, const glm::vec3& dir, const Sampler& sampler, float coneSpread = 0.0f) const;
+	void extendPath(PathState& path) const;
+	void traceStream(const std::vector<glm::vec3>& origins, const std::vector<glm::vec3>& dirs,
+		std::vector<Sampler>& samplers, std::vector<glm::vec3>& radiance, float coneSpread = 0.0f) const;
+	void traceIrradianceStream(const std::vector<glm::vec3>& positions, const std::vector<glm::vec3>& normals,
+		std::vector<Sampler>& samplers, std::vector<glm::vec3>& radiance) const;
+	void traceIrradianceStream(const std::vector<glm::vec3>& positions, const std::vector<glm::vec3>& normals,
+		std::vector<Sampler>& samplers, std::vector<IrradianceSample>& samples) const;
 	float testOcclusionDist(const glm::vec3& origin, const glm::vec3& dir) const;
+
+	// Any-hit queries that only look for occluders closer than maxDistance, so Embree can
+	// stop at the first one it finds instead of searching for the closest hit
+	bool testOcclusion(const glm::vec3& origin, const glm::vec3& dir, float maxDistance) const;
+	void testOcclusionStream(const std::vector<glm::vec3>& origins, const std::vector<glm::vec3>& dirs,
+		float maxDistance, std::vector<unsigned char>& occluded) const;
+
+	// Splits [0, maxDistance] into numBins equal intervals and returns the index of the
+	// nearest interval with an occluder for every ray. Rays without one get numBins if
+	// they hit something farther away and numBins + 1 if they leave the scene. Only
+	// any-hit queries are used, about 1 + log2(numBins) per occluded ray. Telling far hits
+	// from misses takes a second query over [maxDistance, inf) for every ray that is not
+	// occluded within maxDistance, which costs up to a closest-hit query when nothing is
+	// in the way, so mostly open scenes pay close to two traversals per ray.
+	void testOcclusionBinnedStream(const std::vector<glm::vec3>& origins, const std::vector<glm::vec3>& dirs,
+		float maxDistance, int numBins, std::vector<int>& bins) const;
 	float testIntersection(const glm::vec3& origin, const glm::vec3& dir, glm::vec3& normal) const;
 	void setLight(const DirectionalLight& light);
+	glm::vec3 getSunRadiance() const; // Linear color times power
     void setBackgroundCubeMap(const SharedCubeMap& cubemap);
 	void setMaxPathDepth(unsigned int depth);
 	void setClampDepth(unsigned int depth);
 	void setClampRadiance(float radiance);
 
+	// Irradiance / pi maps of the primitives in the order of buildScene(), as baked by the
+	// IlluminationBaker. Once set, paths end at their first hit, which reflects the direct
+	// sun light and the cached irradiance instead of tracing further bounces. A null map
+	// reflects no light. The optional sun layers hold the irradiance of a unit sun, which
+	// is scaled by the current sun and added to the maps.
+	void setIrradianceCache(const std::vector<SharedImage>& maps, const std::vector<SharedImage>& sunMaps = {});
+
+	// Paths of irradiance samples teach the guide where their light came from. Where it has
+	// learned enough, the bounces of diffuse surfaces are sampled from it or from the BSDF,
+	// weighted by one-sample MIS. The first direction of an irradiance sample is no longer
+	// cosine distributed then. Null turns guiding off.
+	void setPathGuide(PathGuide* guide);
+	PathGuide* getPathGuide() const;
+
+	// Every irradiance sample is added to the cache at its receiver. Paths that have bounced
+	// depth times end at their next hit if the cache has irradiance for it, which is then
+	// reflected like the irradiance of a light map in a radiosity pass. Null turns it off.
+	void setRadianceCache(RadianceCache* cache, int depth = 1);
+	RadianceCache* getRadianceCache() const;
+
 private:
 	struct Triangle {
 		unsigned int v0;
@@ -33,21 +130,68 @@ private:
 		unsigned int v2;
 	};
 
+	// Everything that is needed to shade a hit, indexed by the geometry ID. The albedo map
+	// holds linear float RGB and the roughness map a single float channel, both converted
+	// in buildScene(). The images are kept alive by textureImages.
 	struct Material {
-		SharedImage albedoMap;
-		SharedImage normalMap;
-		SharedImage roughnessMap;
-		glm::vec3 baseColor;
+		RTCGeometry geometry;
+		const Image* albedoMap;
+		const Image* normalMap;
+		const Image* roughnessMap;
+		glm::vec3 linearBaseColor;
 		float roughness;
 		float metallic;
+		bool hasLightMapTexCoords;
+		std::vector<float> textureLodBias; // 0.5 * log2(uv area / world area) per triangle
 	};
 
+	struct SurfaceHit {
+		glm::vec3 position;
+		glm::vec3 normal;
+		glm::vec3 V;
+		glm::vec3 diffuse;
+		glm::vec3 specular;
+		glm::vec3 cachedIrradiance; // Only with an irradiance or radiance cache
+		glm::vec3 cachedSunIrradiance; // Part of cachedIrradiance that was emitted by the sun
+		bool hasCachedIrradiance; // Ends the path
+		float roughness;
+		float coneWidth;
+		int guideCell; // -1 if the bounce is not guided
+	};
+
+	void extendPath(PathState& path, RTCIntersectContext* context) const;
+	void tracePaths(std::vector<PathState>& paths, RTCIntersectContext* context) const;
+	SurfaceHit makeReceiver(const glm::vec3& position, const glm::vec3& normal) const;
+	PathState startReceiverPath(const SurfaceHit& receiver, const Sampler& sampler) const;
+	void continuePath(PathState& path, const SurfaceHit& hit, bool isLit, const glm::vec3& environmentRadiance) const;
+	void escapePath(PathState& path) const;
+	void endPath(PathState& path) const;
+	void addGuideVertex(PathState& path, const glm::vec3& position) const;
+	void evaluateSurfaceHit(const RTCRayHit& rayhit, const PathState& path, SurfaceHit& hit) const;
+	glm::vec3 evaluateDirectLight(const SurfaceHit& hit) const;
+	glm::vec3 evaluateBsdf(const SurfaceHit& hit, const glm::vec3& wi) const;
+	float pdfBsdf(const SurfaceHit& hit, const glm::vec3& wi) const;
+	float getGuideProbability(const SurfaceHit& hit) const;
+	float pdfScatter(const SurfaceHit& hit, const glm::vec3& wi) const; // BSDF and guide combined
+	bool sampleEnvironment(PathState& path, const SurfaceHit& hit, bool isContinued, glm::vec3& wi, glm::vec3& radiance) const;
+	bool sampleBsdf(const SurfaceHit& hit, Sampler& sampler, glm::vec3& weight, glm::vec3& wi, float& coneSpread) const;
+	bool sampleGuided(const SurfaceHit& hit, Sampler& sampler, float guideProbability, float rho,
+		glm::vec3& weight, glm::vec3& wi, float& coneSpread) const;
+	glm::vec3 clampContribution(const glm::vec3& radiance, int depth) const;
+
 	RTCDevice device = nullptr;
 	RTCScene scene = nullptr;
-	std::unordered_map<unsigned int, Material> materials;
+	std::vector<Material> materials;
+	std::vector<SharedImage> textureImages;
 	const DirectionalLight* light = nullptr;
     SharedCubeMap backgroundCubeMap;
 	int maxPathDepth = 5;
 	int clampDepth = 0;
 	float clampRadiance = 25.0f;
+	bool useIrradianceCache = false;
+	std::vector<SharedImage> irradianceCache; // Float RGB in the texel layout of the baker
+	std::vector<SharedImage> sunIrradianceCache;
+	PathGuide* pathGuide = nullptr;
+	RadianceCache* radianceCache = nullptr;
+	int radianceCacheDepth = 1;
 };
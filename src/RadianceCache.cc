@@ -0,0 +1,186 @@
+#include "RadianceCache.hh"
+
+#include <glow/common/log.hh>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+	// Entries after the hash of a cell that are tried before its samples are dropped
+	const int maxProbes = 16;
+
+	// Cells with fewer samples are treated as missing
+	const std::uint32_t minCellSamples = 4;
+
+	// Irradiance is stored with 16 fractional bits, single samples are clamped so that a few
+	// fireflies cannot overflow the sums
+	const float fixedPointScale = 65536.0f;
+	const float maxIrradiance = 1.0e6f;
+
+	// 19 bits per coordinate of a cell, centered on the origin
+	const int cellCoordinateBits = 19;
+	const std::int64_t cellCoordinateOffset = std::int64_t(1) << (cellCoordinateBits - 1);
+	const std::uint64_t cellCoordinateMask = (std::uint64_t(1) << cellCoordinateBits) - 1;
+
+	// Bin of a normal on an 8x8 octahedral map
+	std::uint64_t getNormalBin(const glm::vec3& normal) {
+		glm::vec3 n = normal / (std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z));
+		glm::vec2 oct(n.x, n.y);
+		if (n.z < 0.0f) {
+			oct = (glm::vec2(1.0f) - glm::abs(glm::vec2(n.y, n.x))) * glm::vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+		}
+
+		glm::ivec2 bin = glm::clamp(glm::ivec2((oct * 0.5f + glm::vec2(0.5f)) * 8.0f), 0, 7);
+		return static_cast<std::uint64_t>(bin.x + bin.y * 8);
+	}
+
+	std::uint64_t hash64(std::uint64_t x) {
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ull;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebull;
+		x ^= x >> 31;
+		return x;
+	}
+}
+
+RadianceCache::RadianceCache(float cellSize, int capacityLog2)
+	: cellSize(cellSize), capacity(std::size_t(1) << capacityLog2), entries(new Entry[std::size_t(1) << capacityLog2]) {
+	irradiance.resize(capacity);
+	sunIrradiance.resize(capacity);
+	clear();
+}
+
+void RadianceCache::record(const glm::vec3& position, const glm::vec3& normal,
+						   const glm::vec3& irradiance, const glm::vec3& sunIrradiance) {
+	PendingSample sample;
+	sample.key = getKey(position, normal);
+	for (int c = 0; c < 3; ++c) {
+		float values[2] = { irradiance[c], sunIrradiance[c] };
+		for (int i = 0; i < 2; ++i) {
+			float value = glm::clamp(values[i], 0.0f, maxIrradiance);
+			sample.sums[c + i * 3] = static_cast<std::uint64_t>(value * fixedPointScale);
+		}
+	}
+
+	int index = findEntry(sample.key);
+	if (index < 0) {
+		#pragma omp critical(radianceCachePending)
+		pendingSamples.push_back(sample);
+		return;
+	}
+
+	Entry& entry = entries[index];
+	for (int i = 0; i < 6; ++i) {
+		entry.sums[i].fetch_add(sample.sums[i], std::memory_order_relaxed);
+	}
+	entry.numSamples.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RadianceCache::update() {
+	// The sums do not depend on the order of the samples, only the keys need to be sorted
+	std::sort(pendingSamples.begin(), pendingSamples.end(), [](const PendingSample& a, const PendingSample& b) {
+		return a.key < b.key;
+	});
+
+	std::size_t numDropped = 0;
+	for (const PendingSample& sample : pendingSamples) {
+		int index = insertEntry(sample.key);
+		if (index < 0) {
+			++numDropped;
+			continue;
+		}
+
+		Entry& entry = entries[index];
+		for (int i = 0; i < 6; ++i) {
+			entry.sums[i].fetch_add(sample.sums[i], std::memory_order_relaxed);
+		}
+		entry.numSamples.fetch_add(1, std::memory_order_relaxed);
+	}
+	pendingSamples.clear();
+
+	if (numDropped > 0) {
+		glow::warning() << "The radiance cache is full, dropped " << numDropped << " samples of cells without an entry";
+	}
+
+	#pragma omp parallel for
+	for (int i = 0; i < static_cast<int>(capacity); ++i) {
+		const Entry& entry = entries[i];
+		std::uint32_t numSamples = entry.numSamples.load(std::memory_order_relaxed);
+		isValid[i] = numSamples >= minCellSamples;
+		if (!isValid[i]) {
+			continue;
+		}
+
+		float scale = 1.0f / (fixedPointScale * numSamples);
+		for (int c = 0; c < 3; ++c) {
+			irradiance[i][c] = entry.sums[c].load(std::memory_order_relaxed) * scale;
+			sunIrradiance[i][c] = entry.sums[c + 3].load(std::memory_order_relaxed) * scale;
+		}
+	}
+}
+
+void RadianceCache::clear() {
+	for (std::size_t i = 0; i < capacity; ++i) {
+		entries[i].key = 0;
+		for (auto& sum : entries[i].sums) {
+			sum.store(0, std::memory_order_relaxed);
+		}
+		entries[i].numSamples.store(0, std::memory_order_relaxed);
+	}
+	isValid.assign(capacity, 0);
+	pendingSamples.clear();
+}
+
+bool RadianceCache::lookup(const glm::vec3& position, const glm::vec3& normal,
+						   glm::vec3& irradiance, glm::vec3& sunIrradiance) const {
+	int index = findEntry(getKey(position, normal));
+	if (index < 0 || !isValid[index]) {
+		return false;
+	}
+
+	irradiance = this->irradiance[index];
+	sunIrradiance = this->sunIrradiance[index];
+	return true;
+}
+
+std::uint64_t RadianceCache::getKey(const glm::vec3& position, const glm::vec3& normal) const {
+	// Surfaces often lie on the planes between cells, like the walls of a box. Half a cell
+	// along the normal, the points of a surface fall into the same cell from either side.
+	glm::vec3 cell = glm::floor((position + normal * (0.5f * cellSize)) / cellSize);
+	std::uint64_t key = std::uint64_t(1) << 63; // Never zero
+	for (int axis = 0; axis < 3; ++axis) {
+		std::uint64_t coordinate = static_cast<std::uint64_t>(static_cast<std::int64_t>(cell[axis]) + cellCoordinateOffset);
+		key |= (coordinate & cellCoordinateMask) << (axis * cellCoordinateBits);
+	}
+	return key | (getNormalBin(normal) << (3 * cellCoordinateBits));
+}
+
+int RadianceCache::findEntry(std::uint64_t key) const {
+	// Linear probing. Entries are never freed during a bake, so a lookup can stop at the
+	// first free entry.
+	std::size_t index = hash64(key) & (capacity - 1);
+	for (int probe = 0; probe < maxProbes; ++probe, index = (index + 1) & (capacity - 1)) {
+		if (entries[index].key == key) {
+			return static_cast<int>(index);
+		}
+		if (entries[index].key == 0) {
+			return -1;
+		}
+	}
+	return -1;
+}
+
+int RadianceCache::insertEntry(std::uint64_t key) {
+	std::size_t index = hash64(key) & (capacity - 1);
+	for (int probe = 0; probe < maxProbes; ++probe, index = (index + 1) & (capacity - 1)) {
+		if (entries[index].key == key) {
+			return static_cast<int>(index);
+		}
+		if (entries[index].key == 0) {
+			entries[index].key = key;
+			return static_cast<int>(index);
+		}
+	}
+	return -1;
+}
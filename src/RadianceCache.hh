@@ -0,0 +1,54 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// World space cache of irradiance / pi, in a hash table with a fixed number of entries. The
+// entries are keyed by the cell of a grid that a position falls into and by the bin of the
+// normal, so the two sides of a thin wall and the faces at a corner stay apart.
+//
+// Samples are added with record() from any number of threads. Samples of cells that already
+// have an entry go into its sums with fixed point atomic adds, the others are kept aside and
+// update() inserts their cells in the order of their keys. Which cells get an entry, and
+// which are dropped because all entries near their hash are taken, thus only depends on the
+// samples of the pass and not on the order in which threads record them. Lookups only see
+// the values of the last update().
+class RadianceCache {
+public:
+	RadianceCache(float cellSize, int capacityLog2 = 18);
+
+	void record(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& irradiance, const glm::vec3& sunIrradiance);
+	void update();
+	void clear();
+
+	// Mean of the samples recorded in the cell, false if it has too few of them
+	bool lookup(const glm::vec3& position, const glm::vec3& normal, glm::vec3& irradiance, glm::vec3& sunIrradiance) const;
+
+private:
+	struct Entry {
+		std::uint64_t key; // Zero if the entry is free, only changed by update()
+		std::atomic<std::uint64_t> sums[6]; // Irradiance and sun irradiance, fixed point
+		std::atomic<std::uint32_t> numSamples;
+	};
+
+	// Sample of a cell without an entry, waiting for the next update()
+	struct PendingSample {
+		std::uint64_t key;
+		std::uint64_t sums[6];
+	};
+
+	std::uint64_t getKey(const glm::vec3& position, const glm::vec3& normal) const;
+	int findEntry(std::uint64_t key) const;
+	int insertEntry(std::uint64_t key);
+
+	float cellSize;
+	std::size_t capacity;
+	std::unique_ptr<Entry[]> entries;
+	std::vector<PendingSample> pendingSamples;
+	std::vector<glm::vec3> irradiance; // Per entry, as of the last update()
+	std::vector<glm::vec3> sunIrradiance;
+	std::vector<unsigned char> isValid;
+};
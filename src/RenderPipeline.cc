@@ -576,6 +576,10 @@ void RenderPipeline::setExposureAdjustment(float value) {
 	exposureAdjustment = value;
 }
 
+void RenderPipeline::setSkyIntensity(float value) {
+	skyIntensity = value;
+}
+
 void RenderPipeline::renderSceneToShadowMap(const std::vector<Mesh>& meshes, const glm::mat4& lightMatrix) const {
 	if (shadowBuffer->getWidth() != shadowMapSize) {
 		shadowBuffer->bind().resize(shadowMapSize, shadowMapSize);
@@ -631,6 +635,7 @@ void RenderPipeline::renderSceneToFBO(const glow::SharedFramebuffer& targetFbo,
 		p.setUniform("uUseIBL", useIbl);
 		p.setUniform("uDirectLightingFade", directLightingFade);
 		p.setUniform("uIrradianceFade", irradianceFade);
+		p.setUniform("uSkyIntensity", skyIntensity);
 		p.setUniform("uIBLFade", iblFade);
 		p.setUniform("uLocalProbesFade", localProbesFade);
 		p.setUniform("uBloomPercentage", bloomPercentage);
@@ -658,6 +663,9 @@ void RenderPipeline::renderSceneToFBO(const glow::SharedFramebuffer& targetFbo,
 			p.setTexture("uTextureRoughness", mesh.material.roughnessMap);
 			p.setTexture("uTextureNormal", mesh.material.normalMap);
 			p.setTexture("uTextureIrradiance", mesh.material.lightMap);
+			p.setTexture("uTextureSunIrradiance", mesh.material.sunLightMap);
+			p.setTexture("uTextureSunIrradianceNext", mesh.material.nextSunLightMap);
+			p.setUniform("uSunIrradianceBlend", mesh.material.sunLightMapBlend);
 			p.setTexture("uTextureAO", mesh.material.aoMap);
 
 			mesh.vao->bind().draw();
@@ -688,6 +696,7 @@ void RenderPipeline::renderSceneToFBO(const glow::SharedFramebuffer& targetFbo,
 		p.setUniform("uUseIBL", useIbl);
 		p.setUniform("uDirectLightingFade", directLightingFade);
 		p.setUniform("uIrradianceFade", irradianceFade);
+		p.setUniform("uSkyIntensity", skyIntensity);
 		p.setUniform("uIBLFade", iblFade);
 		p.setUniform("uLocalProbesFade", localProbesFade);
 		p.setUniform("uBloomPercentage", bloomPercentage);
@@ -712,6 +721,9 @@ void RenderPipeline::renderSceneToFBO(const glow::SharedFramebuffer& targetFbo,
 			p.setUniform("uMetallic", mesh.material.metallic);
 			p.setUniform("uRoughness", mesh.material.roughness);
 			p.setTexture("uTextureIrradiance", mesh.material.lightMap);
+			p.setTexture("uTextureSunIrradiance", mesh.material.sunLightMap);
+			p.setTexture("uTextureSunIrradianceNext", mesh.material.nextSunLightMap);
+			p.setUniform("uSunIrradianceBlend", mesh.material.sunLightMapBlend);
 			p.setTexture("uTextureAO", mesh.material.aoMap);
 
 			mesh.vao->bind().draw();
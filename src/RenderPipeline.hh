@@ -53,6 +53,10 @@ public:
 	void setBloomPercentage(float value);
 	void setExposureAdjustment(float value);
 
+	// Scales the sky light of the light maps. The sun light in their sun layers follows the
+	// color and power of the attached light.
+	void setSkyIntensity(float value);
+
 private:
 	void renderSceneToShadowMap(const std::vector<Mesh>& meshes, const glm::mat4& lightMatrix) const;
 	void renderSceneToFBO(const glow::SharedFramebuffer& targetFbo,
@@ -129,6 +133,7 @@ private:
 	bool useLocalProbes = true;
 	float bloomPercentage = 0.02f;
 	float exposureAdjustment = 1.0f;
+	float skyIntensity = 1.0f;
 	glm::vec3 debugEnvMapPosition;
 	int debugEnvMapMipLevel = 0;
 	bool showDebugProbeVisGrid = false;
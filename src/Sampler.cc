@@ -0,0 +1,140 @@
+#include "Sampler.hh"
+
+#include <algorithm>
+
+namespace {
+	const std::uint32_t primes[] = {
+		2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+		59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+		137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+		227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+	};
+	const std::uint32_t numPrimes = sizeof(primes) / sizeof(primes[0]);
+
+	std::uint32_t reverseBits(std::uint32_t x) {
+		x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+		x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+		x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+		x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+		return (x >> 16) | (x << 16);
+	}
+
+	// Hash based Owen scrambling (Burley 2020, "Practical Hash-based Owen Scrambling")
+	std::uint32_t laineKarrasPermutation(std::uint32_t x, std::uint32_t seed) {
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return x;
+	}
+
+	std::uint32_t nestedUniformScramble(std::uint32_t x, std::uint32_t seed) {
+		return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+	}
+
+	// The first two dimensions of the Sobol sequence form a (0,2)-sequence in base 2
+	std::uint32_t sobolDim0(std::uint32_t index) {
+		return reverseBits(index);
+	}
+
+	std::uint32_t sobolDim1(std::uint32_t index) {
+		std::uint32_t result = 0;
+		for (std::uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+			if (index & 1u) {
+				result ^= v;
+			}
+		}
+		return result;
+	}
+
+	// Hash based permutation of [0, length) (Kensler 2013, "Correlated Multi-Jittered Sampling")
+	std::uint32_t permute(std::uint32_t i, std::uint32_t length, std::uint32_t p) {
+		std::uint32_t w = length - 1;
+		w |= w >> 1;
+		w |= w >> 2;
+		w |= w >> 4;
+		w |= w >> 8;
+		w |= w >> 16;
+		do {
+			i ^= p;
+			i *= 0xe170893du;
+			i ^= p >> 16;
+			i ^= (i & w) >> 4;
+			i ^= p >> 8;
+			i *= 0x0929eb3fu;
+			i ^= p >> 23;
+			i ^= (i & w) >> 1;
+			i *= 1 | p >> 27;
+			i *= 0x6935fa69u;
+			i ^= (i & w) >> 11;
+			i *= 0x74dcb303u;
+			i ^= (i & w) >> 2;
+			i *= 0x9e501cc3u;
+			i ^= (i & w) >> 2;
+			i *= 0xc860a3dfu;
+			i &= w;
+			i ^= i >> 5;
+		} while (i >= length);
+		return (i + p) % length;
+	}
+
+	// Radical inverse with every digit permuted depending on the digits before it (Owen scrambling).
+	// Without the scrambling the higher Halton dimensions are strongly correlated for small sample counts.
+	float scrambledRadicalInverse(std::uint32_t base, std::uint32_t index, std::uint32_t seed) {
+		double invBase = 1.0 / base;
+		double invBaseN = 1.0;
+		double result = 0.0;
+		std::uint32_t prefix = seed;
+		for (int digit = 0; digit < 24 && invBaseN > 1.0e-7; ++digit) {
+			std::uint32_t next = index / base;
+			std::uint32_t permuted = permute(index - next * base, base, prefix);
+			invBaseN *= invBase;
+			result += permuted * invBaseN;
+			prefix = Sampler::pcgHash(prefix ^ (index - next * base));
+			index = next;
+		}
+		return static_cast<float>(std::min(result, 0.99999994));
+	}
+}
+glm::vec2 Sampler::samplePair(std::uint32_t pair) const {
+	std::uint32_t pairSeed = pcgHash(seed ^ pcgHash(texelIndex ^ pcgHash(pair)));
+
+	switch (sequence) {
+	case SampleSequence::Sobol: {
+		std::uint32_t index = nestedUniformScramble(sampleIndex, pairSeed);
+		std::uint32_t x = nestedUniformScramble(sobolDim0(index), pcgHash(pairSeed));
+		std::uint32_t y = nestedUniformScramble(sobolDim1(index), pcgHash(pairSeed + 1));
+		return glm::vec2(toFloat(x), toFloat(y));
+	}
+
+	case SampleSequence::Halton: {
+		std::uint32_t dim = pair * 2;
+		if (dim + 1 >= numPrimes) {
+			break; // Too many dimensions for a useful Halton sequence
+		}
+
+		float x = scrambledRadicalInverse(primes[dim], sampleIndex, pcgHash(pairSeed));
+		float y = scrambledRadicalInverse(primes[dim + 1], sampleIndex, pcgHash(pairSeed + 1));
+		return glm::vec2(x, y);
+	}
+
+	case SampleSequence::Rank1: {
+		// Generator of the R2 sequence (1/phi2, 1/phi2^2) in 0.32 fixed point. The rotation
+		// follows the golden ratio sequence over the texels, which distributes the error of
+		// neighboring texels like blue noise.
+		const std::uint32_t alphaX = 3242174889u;
+		const std::uint32_t alphaY = 2447445414u;
+		const std::uint32_t golden = 2654435769u;
+		std::uint32_t pairOffset = pcgHash(seed ^ pcgHash(pair));
+		std::uint32_t offsetX = texelIndex * golden + pairOffset;
+		std::uint32_t offsetY = texelIndex * golden + pcgHash(pairOffset);
+		return glm::vec2(toFloat(offsetX + sampleIndex * alphaX), toFloat(offsetY + sampleIndex * alphaY));
+	}
+
+	default:
+		break;
+	}
+
+	return glm::vec2(toFloat(hash(pair * 2)), toFloat(hash(pair * 2 + 1)));
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+
+enum class SampleSequence {
+	Random, // Hashed white noise
+	Sobol, // Shuffled and Owen-scrambled 2D Sobol points per dimension pair
+	Halton, // Owen-scrambled Halton sequence, scrambled per texel
+	Rank1 // Rank-1 lattice (R2 sequence) with a blue-noise rotation per texel
+};
+
+// Counter based sampler. Every random number is a function of the seed, the texel (or pixel)
+// index, the sample index and the current dimension, so a sampler carries no shared state
+// and the result of a bake does not depend on the number of threads or on the scheduling.
+//
+// Dimensions are assigned per path vertex: the first primaryDimensions values are used
+// for the texel jitter, the first ray direction and the first environment sample, then
+// every bounce gets its own block of dimensionsPerBounce values (see startBounce()).
+// The low-discrepancy sequences are stratified per pair of dimensions, so 2D decisions
+// like a direction or the texel jitter should always be drawn with next2D().
+class Sampler {
+public:
+	static constexpr std::uint32_t primaryDimensions = 8;
+	static constexpr std::uint32_t dimensionsPerBounce = 8;
+
+	Sampler(std::uint32_t texelIndex, std::uint32_t sampleIndex, std::uint32_t seed = 0,
+		SampleSequence sequence = SampleSequence::Random)
+		: texelIndex(texelIndex), sampleIndex(sampleIndex), seed(seed), sequence(sequence) {
+	}
+
+	void startBounce(int bounce, std::uint32_t offset = 0) {
+		dimension = primaryDimensions + static_cast<std::uint32_t>(bounce) * dimensionsPerBounce + offset;
+	}
+
+	float next1D() {
+		std::uint32_t dim = dimension++;
+		if (sequence == SampleSequence::Random) {
+			return toFloat(hash(dim));
+		}
+		return samplePair(dim / 2)[dim % 2];
+	}
+
+	glm::vec2 next2D() {
+		if (sequence == SampleSequence::Random || dimension % 2 != 0) {
+			float u1 = next1D();
+			float u2 = next1D();
+			return glm::vec2(u1, u2);
+		}
+
+		glm::vec2 u = samplePair(dimension / 2);
+		dimension += 2;
+		return u;
+	}
+
+	static std::uint32_t pcgHash(std::uint32_t v) {
+		std::uint32_t state = v * 747796405u + 2891336453u;
+		std::uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+		return (word >> 22u) ^ word;
+	}
+
+	static float toFloat(std::uint32_t v) {
+		return static_cast<float>(v >> 8) * (1.0f / 16777216.0f); // [0, 1)
+	}
+
+private:
+	std::uint32_t hash(std::uint32_t dim) const {
+		return pcgHash(seed ^ pcgHash(texelIndex ^ pcgHash(sampleIndex ^ pcgHash(dim))));
+	}
+
+	glm::vec2 samplePair(std::uint32_t pair) const;
+
+	std::uint32_t texelIndex;
+	std::uint32_t sampleIndex;
+	std::uint32_t seed;
+	SampleSequence sequence;
+	std::uint32_t dimension = 0;
+};
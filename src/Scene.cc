@@ -272,11 +272,14 @@ void Scene::buildRealtimeObjects(const std::string& lightMapPath) {
 	auto defaultAoMap = createNullAoMap()->createTexture();
 	std::vector<glow::SharedTexture2D> irradianceMaps;
 	std::vector<glow::SharedTexture2D> aoMaps;
+	std::vector<glow::SharedTexture2D> sunIrradianceMaps;
 
 	if (!lightMapPath.empty()) {
 		std::vector<SharedImage> tempIrrMaps;
 		std::vector<SharedImage> tempAoMaps;
-		readLightMapFromFile(lightMapPath, tempIrrMaps, tempAoMaps);
+		std::vector<SharedImage> tempSunIrrMaps;
+		std::vector<SunKeyframe> sunKeyframes;
+		readLightMapFromFile(lightMapPath, tempIrrMaps, tempAoMaps, tempSunIrrMaps, sunKeyframes);
 
 		for (const auto& map : tempIrrMaps) {
 			irradianceMaps.push_back(map->createTexture());
@@ -285,6 +288,19 @@ void Scene::buildRealtimeObjects(const std::string& lightMapPath) {
 		for (const auto& map : tempAoMaps) {
 			aoMaps.push_back(map->createTexture());
 		}
+
+		for (const auto& map : tempSunIrrMaps) {
+			sunIrradianceMaps.push_back(map->createTexture());
+		}
+
+		for (const auto& keyframe : sunKeyframes) {
+			std::vector<glow::SharedTexture2D> maps;
+			for (const auto& map : keyframe.sunIrradianceMaps) {
+				maps.push_back(map->createTexture());
+			}
+			sunKeyframeDirections.push_back(keyframe.direction);
+			sunKeyframeMaps.push_back(maps);
+		}
 	}
 
 	meshes.reserve(primitives.size());
@@ -383,6 +399,15 @@ void Scene::buildRealtimeObjects(const std::string& lightMapPath) {
 			mesh.material.aoMap = defaultAoMap;
 		}
 
+		// Without sun layers the irradiance maps hold the sun light as well
+		if (!sunIrradianceMaps.empty()) {
+			mesh.material.sunLightMap = sunIrradianceMaps[i];
+		}
+		else {
+			mesh.material.sunLightMap = defaultIrradianceMap;
+		}
+		mesh.material.nextSunLightMap = mesh.material.sunLightMap;
+
 		meshes.push_back(mesh);
 	}
 }
@@ -392,6 +417,29 @@ void Scene::buildPathTracerScene(PathTracer& pathTracer) const {
 	pathTracer.setLight(sun);
 }
 
+bool Scene::hasTimeOfDay() const {
+	return !sunKeyframeDirections.empty();
+}
+
+void Scene::setTimeOfDay(float timeOfDay) {
+	if (sunKeyframeDirections.empty()) {
+		return;
+	}
+
+	int numKeyframes = static_cast<int>(sunKeyframeDirections.size());
+	int keyframe;
+	float blend;
+	getSunKeyframeBlend(numKeyframes, timeOfDay, keyframe, blend);
+	int nextKeyframe = std::min(keyframe + 1, numKeyframes - 1);
+
+	sun.direction = glm::normalize(glm::mix(sunKeyframeDirections[keyframe], sunKeyframeDirections[nextKeyframe], blend));
+	for (std::size_t i = 0; i < meshes.size(); ++i) {
+		meshes[i].material.sunLightMap = sunKeyframeMaps[keyframe][i];
+		meshes[i].material.nextSunLightMap = sunKeyframeMaps[nextKeyframe][i];
+		meshes[i].material.sunLightMapBlend = blend;
+	}
+}
+
 DirectionalLight& Scene::getSun() {
 	return sun;
 }
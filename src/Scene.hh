@@ -21,6 +21,11 @@ public:
 	void buildRealtimeObjects(const std::string& lightMapPath);
 	void buildPathTracerScene(PathTracer& pathTracer) const;
 
+	// Moves the sun along the keyframes of a time-of-day light map and blends their sun
+	// layers, with 0 at sunrise and 1 at sunset
+	bool hasTimeOfDay() const;
+	void setTimeOfDay(float timeOfDay);
+
 	DirectionalLight& getSun();
 	const DirectionalLight& getSun() const;
 	const std::vector<Primitive>& getPrimitives() const;
@@ -42,4 +47,6 @@ private:
 	// Realtime rendering
 	std::vector<glow::SharedTexture2D> textures;
 	std::vector<Mesh> meshes;
+	std::vector<glm::vec3> sunKeyframeDirections;
+	std::vector<std::vector<glow::SharedTexture2D>> sunKeyframeMaps; // Per keyframe and mesh
 };
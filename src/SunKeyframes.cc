@@ -0,0 +1,217 @@
+#include "SunKeyframes.hh"
+
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/packing.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+namespace {
+	// Starts a run of unchanged texels, followed by its length. Quantized deltas are in
+	// [-127, 127], so it cannot be the first channel of a texel.
+	const std::int8_t zeroRunMarker = -128;
+	const int maxZeroRun = 255;
+
+	// Texels are stored as the log2 of their ratio to the base, both offset by this fraction
+	// of the brightest base texel in their tile. The offset bounds the ratios of texels that
+	// go dark, and the error of a texel is relative to its value plus the offset.
+	const float ratioOffsetFraction = 1.0f / 256.0f;
+	const int ratioOffsetTileSize = 8;
+
+	// Ratio offset of every texel
+	std::vector<glm::vec3> getRatioOffsets(const Image& base) {
+		int width = base.getWidth();
+		int height = base.getHeight();
+		int tilesX = (width + ratioOffsetTileSize - 1) / ratioOffsetTileSize;
+		int tilesY = (height + ratioOffsetTileSize - 1) / ratioOffsetTileSize;
+		const glm::u16vec3* baseTexels = base.getDataPtr<glm::u16vec3>();
+
+		std::vector<glm::vec3> tileOffsets(tilesX * tilesY, glm::vec3(0.0f));
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				glm::vec3& tileOffset = tileOffsets[x / ratioOffsetTileSize + y / ratioOffsetTileSize * tilesX];
+				tileOffset = glm::max(tileOffset, glm::unpackHalf(baseTexels[x + y * width]) * ratioOffsetFraction);
+			}
+		}
+
+		std::vector<glm::vec3> offsets(width * height);
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				glm::vec3 tileOffset = tileOffsets[x / ratioOffsetTileSize + y / ratioOffsetTileSize * tilesX];
+				offsets[x + y * width] = glm::max(tileOffset, glm::vec3(1.0e-20f));
+			}
+		}
+		return offsets;
+	}
+
+	glm::vec3 applySunKeyframeDelta(const glm::vec3& base, const glm::vec3& logRatio, const glm::vec3& offset) {
+		return glm::max((base + offset) * glm::exp2(logRatio) - offset, glm::vec3(0.0f));
+	}
+}
+
+std::vector<glm::vec3> getSunArcDirections(const glm::vec3& noonDirection, int numKeyframes) {
+	glm::vec3 up(0.0f, 1.0f, 0.0f);
+	glm::vec3 toNoon = glm::normalize(-noonDirection);
+	glm::vec3 horizontal = toNoon - up * glm::dot(toNoon, up);
+	if (glm::length(horizontal) < 1.0e-4f) {
+		horizontal = glm::vec3(0.0f, 0.0f, 1.0f);
+	}
+	glm::vec3 east = glm::normalize(glm::cross(up, horizontal));
+
+	std::vector<glm::vec3> directions;
+	for (int k = 0; k < numKeyframes; ++k) {
+		float angle = glm::pi<float>() * getSunKeyframeTime(k, numKeyframes);
+		directions.push_back(-(std::cos(angle) * east + std::sin(angle) * toNoon));
+	}
+	return directions;
+}
+
+float getSunKeyframeTime(int keyframe, int numKeyframes) {
+	return (keyframe + 0.5f) / numKeyframes;
+}
+
+void getSunKeyframeBlend(int numKeyframes, float timeOfDay, int& keyframe, float& blend) {
+	if (numKeyframes < 2) {
+		keyframe = 0;
+		blend = 0.0f;
+		return;
+	}
+
+	float position = glm::clamp(timeOfDay * numKeyframes - 0.5f, 0.0f, static_cast<float>(numKeyframes - 1));
+	keyframe = std::min(static_cast<int>(position), numKeyframes - 2);
+	blend = position - keyframe;
+}
+
+std::vector<SharedImage> getSunKeyframeBase(const std::vector<SunKeyframe>& keyframes) {
+	std::vector<SharedImage> baseMaps;
+	if (keyframes.empty()) {
+		return baseMaps;
+	}
+
+	for (std::size_t m = 0; m < keyframes.front().sunIrradianceMaps.size(); ++m) {
+		const Image& first = *keyframes.front().sunIrradianceMaps[m];
+		int numTexels = first.getWidth() * first.getHeight();
+
+		std::vector<glm::vec3> sums(numTexels, glm::vec3(0.0f));
+		for (const SunKeyframe& keyframe : keyframes) {
+			const glm::u16vec3* texels = keyframe.sunIrradianceMaps[m]->getDataPtr<glm::u16vec3>();
+			for (int i = 0; i < numTexels; ++i) {
+				sums[i] += glm::unpackHalf(texels[i]);
+			}
+		}
+
+		SharedImage base = std::make_shared<Image>(first.getWidth(), first.getHeight(), GL_RGB16F);
+		for (int i = 0; i < numTexels; ++i) {
+			base->getDataPtr<glm::u16vec3>()[i] = glm::packHalf(sums[i] / static_cast<float>(keyframes.size()));
+		}
+		baseMaps.push_back(base);
+	}
+
+	return baseMaps;
+}
+
+float writeSunKeyframeDelta(std::ostream& output, const Image& map, const Image& base) {
+	int numTexels = map.getWidth() * map.getHeight();
+	const glm::u16vec3* texels = map.getDataPtr<glm::u16vec3>();
+	const glm::u16vec3* baseTexels = base.getDataPtr<glm::u16vec3>();
+	std::vector<glm::vec3> offsets = getRatioOffsets(base);
+
+	std::vector<glm::vec3> logRatios(numTexels);
+	glm::vec3 maxLogRatio(0.0f);
+	for (int i = 0; i < numTexels; ++i) {
+		logRatios[i] = glm::log2((glm::unpackHalf(texels[i]) + offsets[i]) / (glm::unpackHalf(baseTexels[i]) + offsets[i]));
+		maxLogRatio = glm::max(maxLogRatio, glm::abs(logRatios[i]));
+	}
+
+	glm::vec3 scale = maxLogRatio / 127.0f;
+	glm::vec3 invScale = glm::vec3(1.0f) / glm::max(scale, glm::vec3(1.0e-20f));
+
+	std::vector<std::int8_t> bytes;
+	float maxError = 0.0f;
+	int zeroRun = 0;
+	auto flushZeroRun = [&]() {
+		if (zeroRun > 0) {
+			bytes.push_back(zeroRunMarker);
+			bytes.push_back(static_cast<std::int8_t>(static_cast<std::uint8_t>(zeroRun)));
+			zeroRun = 0;
+		}
+	};
+
+	for (int i = 0; i < numTexels; ++i) {
+		glm::ivec3 quantized = glm::clamp(glm::ivec3(glm::round(logRatios[i] * invScale)), -127, 127);
+
+		glm::vec3 value = glm::unpackHalf(texels[i]);
+		glm::vec3 stored = glm::unpackHalf(baseTexels[i]);
+		if (quantized != glm::ivec3(0)) {
+			stored = glm::unpackHalf(glm::packHalf(applySunKeyframeDelta(stored, glm::vec3(quantized) * scale, offsets[i])));
+		}
+		glm::vec3 error = glm::abs(stored - value) / (value + offsets[i]);
+		maxError = std::max(maxError, std::max(error.x, std::max(error.y, error.z)));
+
+		if (quantized == glm::ivec3(0)) {
+			if (++zeroRun == maxZeroRun) {
+				flushZeroRun();
+			}
+			continue;
+		}
+
+		flushZeroRun();
+		for (int c = 0; c < 3; ++c) {
+			bytes.push_back(static_cast<std::int8_t>(quantized[c]));
+		}
+	}
+	flushZeroRun();
+
+	std::uint32_t numBytes = static_cast<std::uint32_t>(bytes.size());
+	output.write(reinterpret_cast<const char*>(&scale), sizeof(glm::vec3));
+	output.write(reinterpret_cast<const char*>(&numBytes), sizeof(std::uint32_t));
+	output.write(reinterpret_cast<const char*>(bytes.data()), numBytes);
+	return maxError;
+}
+
+SharedImage readSunKeyframeDelta(std::istream& input, const Image& base) {
+	glm::vec3 scale;
+	std::uint32_t numBytes = 0;
+	input.read(reinterpret_cast<char*>(&scale), sizeof(glm::vec3));
+	input.read(reinterpret_cast<char*>(&numBytes), sizeof(std::uint32_t));
+
+	std::vector<std::int8_t> bytes(numBytes);
+	input.read(reinterpret_cast<char*>(bytes.data()), numBytes);
+	if (!input) {
+		return nullptr;
+	}
+
+	int numTexels = base.getWidth() * base.getHeight();
+	const glm::u16vec3* baseTexels = base.getDataPtr<glm::u16vec3>();
+	std::vector<glm::vec3> offsets = getRatioOffsets(base);
+	SharedImage map = std::make_shared<Image>(base.getWidth(), base.getHeight(), GL_RGB16F);
+	glm::u16vec3* texels = map->getDataPtr<glm::u16vec3>();
+
+	int texel = 0;
+	std::size_t i = 0;
+	while (i < bytes.size() && texel < numTexels) {
+		if (bytes[i] == zeroRunMarker && i + 1 < bytes.size()) {
+			int run = static_cast<std::uint8_t>(bytes[i + 1]);
+			for (int r = 0; r < run && texel < numTexels; ++r, ++texel) {
+				texels[texel] = baseTexels[texel];
+			}
+			i += 2;
+		}
+		else if (i + 2 < bytes.size()) {
+			glm::vec3 logRatio = glm::vec3(bytes[i], bytes[i + 1], bytes[i + 2]) * scale;
+			texels[texel] = glm::packHalf(applySunKeyframeDelta(glm::unpackHalf(baseTexels[texel]), logRatio, offsets[texel]));
+			++texel;
+			i += 3;
+		}
+		else {
+			break;
+		}
+	}
+
+	if (texel != numTexels) {
+		return nullptr;
+	}
+	return map;
+}
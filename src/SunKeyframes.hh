@@ -0,0 +1,32 @@
+#pragma once
+
+#include "Image.hh"
+
+#include <glm/glm.hpp>
+#include <iosfwd>
+#include <vector>
+
+// The sun layers of all primitives for one sun direction of a time-of-day bake
+struct SunKeyframe {
+	glm::vec3 direction; // Same convention as DirectionalLight::direction
+	std::vector<SharedImage> sunIrradianceMaps;
+};
+
+// Sun directions for the given times of day on the arc from sunrise to sunset that passes
+// through the given noon direction. The keyframes sit in the middle of equal intervals of
+// the day, so none of them is on the horizon.
+std::vector<glm::vec3> getSunArcDirections(const glm::vec3& noonDirection, int numKeyframes);
+float getSunKeyframeTime(int keyframe, int numKeyframes);
+
+// Keyframe before the given time of day in [0, 1] and the weight of the one after it
+void getSunKeyframeBlend(int numKeyframes, float timeOfDay, int& keyframe, float& blend);
+
+// Per texel mean of the sun layers of all keyframes, which the keyframes are stored against
+std::vector<SharedImage> getSunKeyframeBase(const std::vector<SunKeyframe>& keyframes);
+
+// The ratio of a sun layer to its base layer, quantized in the log domain to 8 bits per
+// channel with a scale per channel and with runs of unchanged texels collapsed. Returns the
+// largest error of a channel after reading it back, relative to the value of the channel
+// plus 1/256 of the brightest base texel in its 8x8 tile.
+float writeSunKeyframeDelta(std::ostream& output, const Image& map, const Image& base);
+SharedImage readSunKeyframeDelta(std::istream& input, const Image& base);
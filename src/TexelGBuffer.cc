@@ -0,0 +1,212 @@
+#include "TexelGBuffer.hh"
+#include "Primitive.hh"
+
+#include <cstdio>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define TEXEL_GBUFFER_MMAP
+#endif
+
+namespace {
+	const std::uint32_t fileMagic = 0x4247544c; // "LTGB"
+	const std::uint32_t fileVersion = 2;
+
+	struct FileHeader {
+		std::uint32_t magic;
+		std::uint32_t version;
+		std::uint64_t key;
+		std::uint64_t numTriangles;
+		std::uint64_t numWork;
+		std::uint64_t numTexelRanges;
+		std::uint32_t triangleSize;
+		std::uint32_t workSize;
+	};
+
+	// The texel ranges directly follow the header, so that they are 8 byte aligned
+	std::size_t getFileSize(const FileHeader& header) {
+		return sizeof(FileHeader) + header.numTexelRanges * sizeof(std::uint64_t)
+			+ header.numTriangles * sizeof(BakeTriangle) + header.numWork * sizeof(TexelWork);
+	}
+
+	bool isValidHeader(const FileHeader& header, std::uint64_t key, std::size_t fileSize) {
+		return header.magic == fileMagic && header.version == fileVersion && header.key == key
+			&& header.triangleSize == sizeof(BakeTriangle) && header.workSize == sizeof(TexelWork)
+			&& getFileSize(header) == fileSize;
+	}
+
+	void hashBytes(std::uint64_t& hash, const void* data, std::size_t size) {
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for (std::size_t i = 0; i < size; ++i) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+	}
+
+	template <typename T>
+	void hashVector(std::uint64_t& hash, const std::vector<T>& values) {
+		std::uint64_t size = values.size();
+		hashBytes(hash, &size, sizeof(size));
+		hashBytes(hash, values.data(), values.size() * sizeof(T));
+	}
+}
+
+TexelGBuffer::TexelGBuffer(std::vector<BakeTriangle> triangles, std::vector<TexelWork> work, std::vector<std::uint64_t> texelRanges)
+		: ownedTriangles(std::move(triangles)), ownedWork(std::move(work)), ownedTexelRanges(std::move(texelRanges)) {
+	this->triangles = ownedTriangles.data();
+	this->work = ownedWork.data();
+	this->texelRanges = ownedTexelRanges.data();
+	numTriangles = ownedTriangles.size();
+	numWork = ownedWork.size();
+	numTexelRanges = ownedTexelRanges.size();
+}
+
+TexelGBuffer::~TexelGBuffer() {
+#ifdef TEXEL_GBUFFER_MMAP
+	if (mappedData) {
+		munmap(mappedData, mappedSize);
+	}
+#endif
+}
+
+std::shared_ptr<TexelGBuffer> TexelGBuffer::loadFromFile(const std::string& path, std::uint64_t key) {
+	std::shared_ptr<TexelGBuffer> gbuffer(new TexelGBuffer());
+
+#ifdef TEXEL_GBUFFER_MMAP
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) != 0 || static_cast<std::size_t>(fileStat.st_size) < sizeof(FileHeader)) {
+		close(fd);
+		return nullptr;
+	}
+
+	std::size_t fileSize = static_cast<std::size_t>(fileStat.st_size);
+	void* data = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return nullptr;
+	}
+
+	gbuffer->mappedData = data;
+	gbuffer->mappedSize = fileSize;
+
+	const FileHeader& header = *static_cast<const FileHeader*>(data);
+	if (!isValidHeader(header, key, fileSize)) {
+		return nullptr;
+	}
+
+	const char* bytes = static_cast<const char*>(data) + sizeof(FileHeader);
+	gbuffer->texelRanges = reinterpret_cast<const std::uint64_t*>(bytes);
+	bytes += header.numTexelRanges * sizeof(std::uint64_t);
+	gbuffer->triangles = reinterpret_cast<const BakeTriangle*>(bytes);
+	bytes += header.numTriangles * sizeof(BakeTriangle);
+	gbuffer->work = reinterpret_cast<const TexelWork*>(bytes);
+#else
+	std::ifstream inputFile(path, std::ios::binary | std::ios::in | std::ios::ate);
+	if (!inputFile) {
+		return nullptr;
+	}
+
+	std::size_t fileSize = static_cast<std::size_t>(inputFile.tellg());
+	inputFile.seekg(0);
+
+	FileHeader header;
+	if (fileSize < sizeof(FileHeader) || !inputFile.read(reinterpret_cast<char*>(&header), sizeof(FileHeader))
+			|| !isValidHeader(header, key, fileSize)) {
+		return nullptr;
+	}
+
+	gbuffer->ownedTexelRanges.resize(header.numTexelRanges);
+	gbuffer->ownedTriangles.resize(header.numTriangles);
+	gbuffer->ownedWork.resize(header.numWork);
+	inputFile.read(reinterpret_cast<char*>(gbuffer->ownedTexelRanges.data()), header.numTexelRanges * sizeof(std::uint64_t));
+	inputFile.read(reinterpret_cast<char*>(gbuffer->ownedTriangles.data()), header.numTriangles * sizeof(BakeTriangle));
+	inputFile.read(reinterpret_cast<char*>(gbuffer->ownedWork.data()), header.numWork * sizeof(TexelWork));
+
+	gbuffer->texelRanges = gbuffer->ownedTexelRanges.data();
+	gbuffer->triangles = gbuffer->ownedTriangles.data();
+	gbuffer->work = gbuffer->ownedWork.data();
+#endif
+
+	gbuffer->numTriangles = header.numTriangles;
+	gbuffer->numWork = header.numWork;
+	gbuffer->numTexelRanges = header.numTexelRanges;
+	return gbuffer;
+}
+
+bool TexelGBuffer::writeToFile(const std::string& path, std::uint64_t key) const {
+	// Written to a temporary file first, so that an interrupted bake never leaves a
+	// truncated file behind that would be mapped by the next one
+	std::string tempPath = path + ".tmp";
+	std::ofstream outputFile(tempPath, std::ios::binary | std::ios::trunc | std::ios::out);
+	if (!outputFile) {
+		return false;
+	}
+
+	FileHeader header = {};
+	header.magic = fileMagic;
+	header.version = fileVersion;
+	header.key = key;
+	header.numTriangles = numTriangles;
+	header.numWork = numWork;
+	header.numTexelRanges = numTexelRanges;
+	header.triangleSize = sizeof(BakeTriangle);
+	header.workSize = sizeof(TexelWork);
+
+	outputFile.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
+	outputFile.write(reinterpret_cast<const char*>(texelRanges), numTexelRanges * sizeof(std::uint64_t));
+	outputFile.write(reinterpret_cast<const char*>(triangles), numTriangles * sizeof(BakeTriangle));
+	outputFile.write(reinterpret_cast<const char*>(work), numWork * sizeof(TexelWork));
+	outputFile.close();
+
+	if (!outputFile) {
+		std::remove(tempPath.c_str());
+		return false;
+	}
+
+#ifdef _WIN32
+	// Unlike POSIX rename, the Windows one fails if the destination exists
+	std::remove(path.c_str());
+#endif
+	return std::rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+const BakeTriangle* TexelGBuffer::getTriangles() const {
+	return triangles;
+}
+
+const TexelWork* TexelGBuffer::getWork() const {
+	return work;
+}
+
+const std::uint64_t* TexelGBuffer::getTexelRanges() const {
+	return texelRanges;
+}
+
+std::size_t TexelGBuffer::getWorkCount() const {
+	return numWork;
+}
+
+int TexelGBuffer::getTexelCount() const {
+	return numTexelRanges > 0 ? static_cast<int>(numTexelRanges) - 1 : 0;
+}
+
+std::uint64_t getTexelGBufferKey(const Primitive& primitive, int width, int height) {
+	std::uint64_t hash = 14695981039346656037ull;
+	hashBytes(hash, &fileVersion, sizeof(fileVersion));
+	hashBytes(hash, &width, sizeof(width));
+	hashBytes(hash, &height, sizeof(height));
+	hashBytes(hash, &primitive.transform, sizeof(primitive.transform));
+	hashVector(hash, primitive.positions);
+	hashVector(hash, primitive.normals);
+	hashVector(hash, primitive.lightMapTexCoords);
+	hashVector(hash, primitive.indices);
+	return hash;
+}
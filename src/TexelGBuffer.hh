@@ -0,0 +1,72 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Primitive;
+
+struct BakeTriangle {
+	glm::vec3 baryDx; // Change of the barycentric coordinates per texel
+	glm::vec3 baryDy;
+	glm::vec3 v0;
+	glm::vec3 v1;
+	glm::vec3 v2;
+	glm::vec3 n0;
+	glm::vec3 n1;
+	glm::vec3 n2;
+	unsigned int chart; // Connected part of the light map layout, the same for all triangles of a chart
+};
+
+// A texel that is (conservatively) covered by a triangle
+struct TexelWork {
+	int texelIndex;
+	unsigned int triangle;
+	glm::vec3 barycentric; // At the texel center, can be outside of the triangle
+};
+
+// The rasterized light map of a primitive: its triangles in world space and the texel
+// records grouped by texel, where the records of texel i are [texelRanges[i], texelRanges[i + 1]).
+// The data is either owned or a view of a memory mapped cache file.
+class TexelGBuffer {
+public:
+	TexelGBuffer(std::vector<BakeTriangle> triangles, std::vector<TexelWork> work, std::vector<std::uint64_t> texelRanges);
+	~TexelGBuffer();
+
+	TexelGBuffer(const TexelGBuffer&) = delete;
+	TexelGBuffer& operator=(const TexelGBuffer&) = delete;
+
+	// Returns nullptr if the file does not exist or was written for a different key
+	static std::shared_ptr<TexelGBuffer> loadFromFile(const std::string& path, std::uint64_t key);
+	bool writeToFile(const std::string& path, std::uint64_t key) const;
+
+	const BakeTriangle* getTriangles() const;
+	const TexelWork* getWork() const;
+	const std::uint64_t* getTexelRanges() const;
+	std::size_t getWorkCount() const;
+	int getTexelCount() const;
+
+private:
+	TexelGBuffer() = default;
+
+	std::vector<BakeTriangle> ownedTriangles;
+	std::vector<TexelWork> ownedWork;
+	std::vector<std::uint64_t> ownedTexelRanges;
+
+	const BakeTriangle* triangles = nullptr;
+	const TexelWork* work = nullptr;
+	const std::uint64_t* texelRanges = nullptr;
+	std::size_t numTriangles = 0;
+	std::size_t numWork = 0;
+	std::size_t numTexelRanges = 0;
+
+	void* mappedData = nullptr;
+	std::size_t mappedSize = 0;
+};
+
+using SharedTexelGBuffer = std::shared_ptr<TexelGBuffer>;
+
+// Hash of everything that determines the rasterized light map of a primitive
+std::uint64_t getTexelGBufferKey(const Primitive& primitive, int width, int height);